@@ -0,0 +1,358 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <algorithm>
+#include "esp_heap_caps.h"
+#include "LIGHTING.h"
+#include "DEV_LED.h"
+
+#define BENCH_COMMAND_CHAR 'b'      // serial command that runs the benchmark
+#define BENCH_ROUNDS 32             // times every timeline is replayed
+#define BENCH_BURST 16              // HomeKit writes in a burst, at most LIGHTING_QUEUE_SIZE
+#define BENCH_IDLE_LOOPS 1000       // idle lighting iterations measured
+#define BENCH_SAMPLES 512           // latency samples kept per measurement
+#define BENCH_SLIDER_PERIOD 10000   // us between the HomeKit writes of a slider drag, 100 Hz
+#define BENCH_SLIDER_WRITES 200     // writes of the slider drag, two seconds
+
+// =====================================================================================
+// BENCH_PRESS: One completed press of a recorded pushbutton timeline
+// =====================================================================================
+struct BENCH_PRESS {
+    uint8_t button;                             // pushbutton index
+    uint8_t pressType;                          // SpanButton::SINGLE, SpanButton::DOUBLE or SpanButton::LONG
+};
+
+// Wall switch usage recorded on the controller: lights on, reading lamps on and off from
+// the bed, standing lamp by double click and everything off with a long press
+constexpr BENCH_PRESS benchPresses[] = {
+    { 0, SpanButton::SINGLE }, { 0, SpanButton::DOUBLE }, { 1, SpanButton::SINGLE }, { 2, SpanButton::SINGLE },
+    { 0, SpanButton::SINGLE }, { 1, SpanButton::DOUBLE }, { 1, SpanButton::SINGLE }, { 2, SpanButton::DOUBLE },
+    { 2, SpanButton::SINGLE }, { 1, SpanButton::LONG },   { 0, SpanButton::SINGLE }, { 0, SpanButton::LONG },
+};
+
+// =====================================================================================
+// BENCH_STATS: Latency samples of one measurement, in CPU cycles
+// =====================================================================================
+struct BENCH_STATS {
+
+    uint32_t samples[BENCH_SAMPLES];            // measured latencies
+    int nSamples = 0;                           // sample counter
+
+    // -----------------------------------------------------------------------------------
+    // add() method
+    //
+    // stores a sample, extra samples are dropped
+    // -----------------------------------------------------------------------------------
+    void add(uint32_t cycles) {
+        if (nSamples < BENCH_SAMPLES) {
+            samples[nSamples++] = cycles;
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // report() method
+    //
+    // prints the percentiles on Serial and clears the samples
+    // name             measurement name
+    // allocations      heap blocks allocated while measuring
+    // -----------------------------------------------------------------------------------
+    void report(const char *name, int allocations) {
+        if (nSamples == 0) {
+            return;
+        }
+        std::sort(samples, samples + nSamples);
+        float mhz = ESP.getCpuFreqMHz();
+        Serial.printf("%-24s n=%-4d p50=%7.2f us  p90=%7.2f us  p99=%7.2f us  max=%7.2f us  heap blocks %+d\n", name, nSamples,
+                      samples[nSamples * 50 / 100] / mhz, samples[nSamples * 90 / 100] / mhz,
+                      samples[nSamples * 99 / 100] / mhz, samples[nSamples - 1] / mhz, allocations);
+        nSamples = 0;
+    }
+};
+
+// =====================================================================================
+// BENCHMARK: Replays recorded pushbutton timelines and HomeKit write bursts through the
+//            lighting engine and reports their latency
+//
+// The 'b' serial command first drags the colour of the first RGB light from loop(), then
+// posts the rest to the lighting side. Press latency is measured from the
+// call to buttonManager.dispatch() until every output of the press is staged. Burst
+// latency is measured from the first HomeKit write, including its HSV to duty
+// conversion, until the last one is staged. Relay scenes are never committed and
+// pushbutton events go to a private queue, so relays keep still and HomeKit sees
+// nothing. PWM lamps do follow the replay and get their state back at the end.
+// Heap blocks are counted over the whole heap, so other tasks allocating at the same
+// time show up as well.
+// =====================================================================================
+struct BENCHMARK {
+
+    LAMP saved[MAX_LAMPS];                      // lamp states before the benchmark
+    SPSC_QUEUE<LIGHT_EVENT, LIGHTING_QUEUE_SIZE> events;   // pushbutton events of the replay
+    SCENE scene;                                // staged outputs, never committed
+    BENCH_STATS stats;                          // samples of the running measurement
+    uint32_t start;                             // cycle count when the measurement started
+    DEV_RgbLED *slider = NULL;                  // light being dragged by loop(), NULL if no drag is running
+    uint16_t sliderSaved[3];                    // hue, saturation and brightness before the drag
+    boolean sliderPower;                        // power before the drag
+    uint32_t sliderStart;                       // esp_timer time in us the drag started
+    uint32_t sliderSends;                       // sends of the light seen so far
+    uint32_t sliderOldest;                      // esp_timer time in us of the oldest write not sent yet
+    int written;                                // writes of the drag done
+    int blocks;                                 // heap blocks when the drag started
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // registers the serial command
+    // -----------------------------------------------------------------------------------
+    void begin() {
+        new SpanUserCommand(BENCH_COMMAND_CHAR, "- benchmarks the pushbutton and HomeKit paths (headboard may flicker)", command);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // command() method
+    //
+    // SpanUserCommand callback, starts the slider drag, or hands the benchmark to the
+    // lighting side if there is no RGB light
+    // -----------------------------------------------------------------------------------
+    static void command(const char *buf);
+
+    // -----------------------------------------------------------------------------------
+    // post() method
+    //
+    // hands the lighting side measurements to the lighting engine
+    // -----------------------------------------------------------------------------------
+    void post() {
+        if (!lighting.post(run)) {
+            Serial.printf("\n*** Lighting engine busy, try again ***\n\n");
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // run() method
+    //
+    // lighting side: runs every measurement
+    // -----------------------------------------------------------------------------------
+    static void run();
+
+    // -----------------------------------------------------------------------------------
+    // press() method
+    //
+    // dispatch handler, stages the press like LIGHTING::press() and takes the sample
+    // -----------------------------------------------------------------------------------
+    void press(const BUTTON_DISPATCH *entries, int n) {
+        for (int i = 0; i < n; i++) {
+            if (entries[i].lamp < lighting.nLamps) {
+                lighting.lamps[entries[i].lamp].stageAction(entries[i].action, scene);
+            }
+        }
+        stats.add(ESP.getCycleCount() - start);
+        scene.begin();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // replayPresses() method
+    //
+    // replays the recorded pushbutton timeline
+    // -----------------------------------------------------------------------------------
+    void replayPresses() {
+        int blocks = allocatedBlocks();
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            for (const BENCH_PRESS &p : benchPresses) {
+                start = ESP.getCycleCount();
+                buttonManager.dispatch(p.button, p.pressType, *this);
+                LIGHT_EVENT event;
+                while (events.pop(event)) {
+                }
+            }
+        }
+        stats.report("press to output", allocatedBlocks() - blocks);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // replayBursts() method
+    //
+    // replays bursts of HomeKit writes to the first PWM lamp, like a colour wheel drag
+    // -----------------------------------------------------------------------------------
+    void replayBursts() {
+        LAMP *lamp = pwmLamp();
+        if (lamp == NULL) {
+            return;
+        }
+        int blocks = allocatedBlocks();
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            start = ESP.getCycleCount();
+            for (int i = 0; i < BENCH_BURST; i++) {
+                HSV_COLOR color;
+                color.set((uint16_t) ((round * BENCH_BURST + i) * 7 % 360), (uint8_t) 100, (uint8_t) (20 + i * 5));
+                RGB_DUTY duty;
+                HSVtoDuty(color, duty);
+                LIGHT_COMMAND command = {lamp->index, 1, {duty.r, duty.g, duty.b}, 0, EFFECT_NONE};
+                lighting.applyCommand(command, scene);
+            }
+            stats.add(ESP.getCycleCount() - start);
+            scene.begin();
+        }
+        stats.report("HomeKit burst to output", allocatedBlocks() - blocks);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // startSlider() method
+    //
+    // starts dragging the colour of the first RGB light, returns false if there is none
+    // -----------------------------------------------------------------------------------
+    boolean startSlider() {
+        for (int i = 0; i < lighting.nLamps; i++) {
+            LAMP &lamp = lighting.lamps[i];
+            if (lamp.accessory != NULL && lamp.mix == RGB_MODEL::mix) {
+                slider = static_cast<DEV_RgbLED *>(lamp.accessory);     // only DEV_RgbLED mixes with RGB_MODEL
+                break;
+            }
+        }
+        if (slider == NULL) {
+            return false;
+        }
+        sliderPower = slider->power->getVal();
+        for (int i = 0; i < 3; i++) {
+            sliderSaved[i] = slider->values[i]->getVal();
+        }
+        sliderStart = (uint32_t) esp_timer_get_time();
+        sliderSends = slider->target.sends;
+        written = 0;
+        blocks = allocatedBlocks();
+        return true;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // loop() method
+    //
+    // HomeSpan side, must be called from loop(). Plays the slider drag one step per call:
+    // a write every BENCH_SLIDER_PERIOD through the characteristics and update(), sent by
+    // DEV_PwmLED::loop() from homeSpan.poll() like a drag in the Home app, so pushbuttons
+    // and HomeKit are served meanwhile. Lag is taken from the oldest write not sent yet
+    // until the loop() iteration that handed it to the lighting engine. The light gets its
+    // values back at the end
+    // -----------------------------------------------------------------------------------
+    void loop() {
+        if (slider == NULL) {
+            return;
+        }
+        uint32_t now = (uint32_t) esp_timer_get_time();
+        if (slider->target.sends != sliderSends) {
+            sliderSends = slider->target.sends;
+            stats.add((now - sliderOldest) * ESP.getCpuFreqMHz());
+        }
+        if (written < BENCH_SLIDER_WRITES && now - sliderStart >= (uint32_t) written * BENCH_SLIDER_PERIOD) {
+            write(true, written * 7 % 360, 100, 20 + written % 80);
+            written++;
+        } else if (written == BENCH_SLIDER_WRITES && !slider->target.pending) {
+            Serial.printf("%-24s %d writes at %u Hz, %d sends\n", "HomeKit slider", BENCH_SLIDER_WRITES, 1000000 / BENCH_SLIDER_PERIOD, stats.nSamples);
+            stats.report("HomeKit slider lag", allocatedBlocks() - blocks);
+            write(sliderPower, sliderSaved[0], sliderSaved[1], sliderSaved[2]);
+            slider->flush();
+            slider = NULL;
+            post();
+            return;
+        }
+        if (slider->target.pending) {
+            sliderOldest = slider->target.writeTime;
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // write() method
+    //
+    // writes the light as HomeSpan does for a HomeKit request, without notifying HomeKit
+    // -----------------------------------------------------------------------------------
+    void write(boolean power, uint16_t hue, uint16_t saturation, uint16_t brightness) {
+        slider->power->setVal(power, false);
+        slider->values[0]->setVal(hue, false);
+        slider->values[1]->setVal(saturation, false);
+        slider->values[2]->setVal(brightness, false);
+        slider->update();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // measureIdle() method
+    //
+    // measures the lighting iteration with nothing to do
+    // -----------------------------------------------------------------------------------
+    void measureIdle() {
+        int blocks = allocatedBlocks();
+        for (int i = 0; i < BENCH_IDLE_LOOPS; i++) {
+            start = ESP.getCycleCount();
+            lighting.process();
+            stats.add(ESP.getCycleCount() - start);
+        }
+        stats.report("idle lighting loop", allocatedBlocks() - blocks);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // save() and restore() methods
+    //
+    // keep the lamps aside while replaying and bring them back afterwards
+    // -----------------------------------------------------------------------------------
+    void save() {
+        for (int i = 0; i < lighting.nLamps; i++) {
+            saved[i] = lighting.lamps[i];
+            lighting.lamps[i].events = &events;
+        }
+    }
+
+    void restore() {
+        for (int i = 0; i < lighting.nLamps; i++) {
+            lighting.lamps[i] = saved[i];
+            lighting.lamps[i].apply(scene);
+        }
+        scene.begin();                      // relays never moved
+    }
+
+    // -----------------------------------------------------------------------------------
+    // pwmLamp() method
+    //
+    // returns the first PWM lamp, NULL if there is none
+    // -----------------------------------------------------------------------------------
+    static LAMP *pwmLamp() {
+        for (int i = 0; i < lighting.nLamps; i++) {
+            if (lighting.lamps[i].nChannels > 0) {
+                return &lighting.lamps[i];
+            }
+        }
+        return NULL;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // allocatedBlocks() method
+    //
+    // returns the heap blocks in use
+    // -----------------------------------------------------------------------------------
+    static int allocatedBlocks() {
+        multi_heap_info_t info;
+        heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+        return info.total_allocated_blocks;
+    }
+};
+
+BENCHMARK benchmark;                        // on demand latency benchmark
+
+void BENCHMARK::command(const char *buf) {
+    if (benchmark.slider != NULL || lighting.job.load() != NULL) {
+        Serial.printf("\n*** Benchmark running, try again ***\n\n");
+        return;
+    }
+    Serial.printf("\n*** Benchmark started ***\n\n");
+    if (!benchmark.startSlider()) {
+        benchmark.post();
+    }
+}
+
+void BENCHMARK::run() {
+    Serial.printf("Running on core %d at %u MHz, %d rounds\n", xPortGetCoreID(), ESP.getCpuFreqMHz(), BENCH_ROUNDS);
+    benchmark.save();
+    benchmark.replayPresses();
+    benchmark.replayBursts();
+    benchmark.restore();
+    benchmark.measureIdle();
+    Serial.printf("\n*** End benchmark ***\n\n");
+}
+
+#endif
@@ -0,0 +1,509 @@
+#ifndef BUTTON_MANAGER_H
+#define BUTTON_MANAGER_H
+
+#include "soc/gpio_reg.h"
+#include "soc/gpio_struct.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "SPSC_QUEUE.h"
+#include "TRACE.h"
+#include "METRICS.h"
+
+// Redefine time for button actions
+#define LONGPULSE 1200
+#define MINIMUMPULSE 10
+#define SHORTPULSE 300
+
+// Action definitions for pushbuttons
+#define NOTHING -1
+#define OFF 0
+#define ON 1
+#define TOGGLE 2
+
+#define BUTTON_PRESS_TYPES 3        // SpanButton::SINGLE, SpanButton::DOUBLE and SpanButton::LONG
+#define MAX_BUTTONS 8               // pushbuttons with edge capture
+#define BUTTON_EDGE_QUEUE_SIZE 64   // edges that can be pending, power of two
+#define NO_DEADLINE 0xFFFFFFFF      // no press waiting on a timeout
+
+// ---------------------------------------------------------------------------------------
+// Action2Name() method
+//
+// returns action name
+// action         Action id
+// ---------------------------------------------------------------------------------------
+const char *Action2Name(int action) {
+    return ((action == ON ? "Turns ON" : (action == OFF ? "Turns OFF" : (action == TOGGLE ? "Toggles ON or OFF" : "Does nothing"))));
+
+}
+
+// ---------------------------------------------------------------------------------------
+// PressType2Name() method
+//
+// returns press type name
+// pressType      SpanButton::SINGLE, SpanButton::DOUBLE or SpanButton::LONG
+// ---------------------------------------------------------------------------------------
+const char *PressType2Name(int pressType) {
+    return (pressType == SpanButton::LONG ? "LONG" : (pressType == SpanButton::SINGLE ? "SINGLE" : (pressType == SpanButton::DOUBLE ? "DOUBLE" : "???")));
+}
+
+// =====================================================================================
+// BUTTON_RULE: What a lamp does on each press type of a pushbutton
+//
+// A lamp without a rule for a pushbutton does NOTHING on any of its presses
+// =====================================================================================
+struct BUTTON_RULE {
+
+    int lamp;                                   // lamp id, order in which the accessories are created
+    int pin;                                    // input pin of the pushbutton
+    int actionOnLong;                           // action to be done on long press (ON, OFF, TOGGLE or NOTHING)
+    int actionOnSingle;                         // action to be done on normal press (ON, OFF, TOGGLE or NOTHING)
+    int actionOnDouble;                         // action to be done on quick double click (ON, OFF, TOGGLE or NOTHING)
+
+    // -----------------------------------------------------------------------------------
+    // action() method
+    //
+    // returns the action for a press type
+    // -----------------------------------------------------------------------------------
+    constexpr int action(int pressType) const {
+        return pressType == SpanButton::LONG ? actionOnLong : (pressType == SpanButton::SINGLE ? actionOnSingle : actionOnDouble);
+    }
+};
+
+// =====================================================================================
+// BUTTON_DISPATCH: One lamp driven by one (pushbutton, press type)
+// =====================================================================================
+struct BUTTON_DISPATCH {
+    uint8_t lamp = 0;                           // lamp id
+    int8_t action = NOTHING;                    // ON, OFF or TOGGLE
+};
+
+// =====================================================================================
+// BUTTON_WIRING: Dispatch table generated by the compiler from the pushbutton pins and
+//                the rules, meant to be declared constexpr so it lives in flash
+//
+// Entries are grouped by (pushbutton, press type), first[] holds where each group starts.
+// NOTHING actions are not stored so they cost nothing on a press
+// =====================================================================================
+template <int BUTTONS, int RULES>
+struct BUTTON_WIRING {
+
+    uint8_t pin[BUTTONS];                                   // input pins of the pushbuttons
+    uint16_t first[BUTTONS * BUTTON_PRESS_TYPES + 1];       // first entry for each (pushbutton, press type)
+    BUTTON_DISPATCH entry[RULES * BUTTON_PRESS_TYPES];      // dispatch entries
+
+    constexpr BUTTON_WIRING(const int (&pins)[BUTTONS], const BUTTON_RULE (&rules)[RULES]) : pin(), first(), entry() {
+        int n = 0;
+        for (int b = 0; b < BUTTONS; b++) {
+            pin[b] = pins[b];
+            for (int t = 0; t < BUTTON_PRESS_TYPES; t++) {
+                first[b * BUTTON_PRESS_TYPES + t] = n;
+                for (int r = 0; r < RULES; r++) {
+                    if (rules[r].pin == pins[b] && rules[r].action(t) != NOTHING) {
+                        entry[n].lamp = rules[r].lamp;
+                        entry[n].action = rules[r].action(t);
+                        n++;
+                    }
+                }
+            }
+        }
+        first[BUTTONS * BUTTON_PRESS_TYPES] = n;
+    }
+};
+
+// ---------------------------------------------------------------------------------------
+// MakeButtonWiring() method
+//
+// builds the dispatch table deducing its size from the arrays
+// ---------------------------------------------------------------------------------------
+template <int BUTTONS, int RULES>
+constexpr BUTTON_WIRING<BUTTONS, RULES> MakeButtonWiring(const int (&pins)[BUTTONS], const BUTTON_RULE (&rules)[RULES]) {
+    return BUTTON_WIRING<BUTTONS, RULES>(pins, rules);
+}
+
+// ---------------------------------------------------------------------------------------
+// UniquePushbuttons() method
+//
+// compile time check, returns true if no pin is listed twice as pushbutton
+// ---------------------------------------------------------------------------------------
+template <int BUTTONS>
+constexpr boolean UniquePushbuttons(const int (&pins)[BUTTONS]) {
+    for (int i = 0; i < BUTTONS; i++) {
+        for (int j = i + 1; j < BUTTONS; j++) {
+            if (pins[i] == pins[j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------
+// ValidButtonRules() method
+//
+// compile time check, returns true if every rule is for a known pushbutton and a known
+// lamp with valid actions
+// ---------------------------------------------------------------------------------------
+template <int BUTTONS, int RULES>
+constexpr boolean ValidButtonRules(const int (&pins)[BUTTONS], const BUTTON_RULE (&rules)[RULES], int lamps) {
+    for (int r = 0; r < RULES; r++) {
+        boolean known = false;
+        for (int b = 0; b < BUTTONS; b++) {
+            known = known || rules[r].pin == pins[b];
+        }
+        if (!known || rules[r].lamp < 0 || rules[r].lamp >= lamps) {
+            return false;
+        }
+        for (int t = 0; t < BUTTON_PRESS_TYPES; t++) {
+            if (rules[r].action(t) < NOTHING || rules[r].action(t) > TOGGLE) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------
+// UniqueButtonRules() method
+//
+// compile time check, returns true if no lamp has two rules for the same pushbutton
+// ---------------------------------------------------------------------------------------
+template <int RULES>
+constexpr boolean UniqueButtonRules(const BUTTON_RULE (&rules)[RULES]) {
+    for (int i = 0; i < RULES; i++) {
+        for (int j = i + 1; j < RULES; j++) {
+            if (rules[i].lamp == rules[j].lamp && rules[i].pin == rules[j].pin) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------
+// ReadButton() method
+//
+// returns true if the pushbutton on a pin is down, buttons pull the input LOW
+// pin            input pin
+// ---------------------------------------------------------------------------------------
+boolean ReadButton(int pin) {
+    return !(((pin < 32 ? REG_READ(GPIO_IN_REG) : REG_READ(GPIO_IN1_REG)) >> (pin & 31)) & 1);
+}
+
+// ---------------------------------------------------------------------------------------
+// ArmWakeup() method
+//
+// turns the interrupt of a pin into a level interrupt waiting for the level it does not
+// have, which can also wake the chip from light sleep. Re-armed on every edge, it
+// behaves as an edge interrupt. Safe from the GPIO interrupt
+// pin            input pin
+// pressed        current pushbutton state, see ReadButton()
+// ---------------------------------------------------------------------------------------
+inline void ARDUINO_ISR_ATTR ArmWakeup(int pin, boolean pressed) {
+    GPIO.pin[pin].int_type = pressed ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL;
+    GPIO.pin[pin].wakeup_enable = 1;
+}
+
+// =====================================================================================
+// BUTTON_EDGE: Level change of a pushbutton, captured by the GPIO interrupt
+// =====================================================================================
+struct BUTTON_EDGE {
+    uint32_t time;                              // esp_timer time in us
+    uint8_t button;                             // pushbutton index
+    uint8_t pressed;                            // 1 if the button is down after the edge
+};
+
+// =====================================================================================
+// PRESS_CLASSIFIER: Turns the edges of one pushbutton into SINGLE, DOUBLE or LONG presses
+//
+// Same rules as HomeSpan PushButton::triggered(MINIMUMPULSE, LONGPULSE, SHORTPULSE), but
+// every decision is taken from the edge timestamps, so a late poll still gives the press
+// the user did. Edges closer than MINIMUMPULSE to the last accepted one are bounces, the
+// level is taken again once the bounce window is over in case the last edge was dropped.
+// =====================================================================================
+struct PRESS_CLASSIFIER {
+
+    enum { IDLE, PRESSED, RELEASED, SECOND, HELD };
+
+    uint8_t state = IDLE;                       // press state
+    boolean pressed = false;                    // debounced level
+    boolean bounced = false;                    // true if an edge was dropped as a bounce
+    uint32_t edgeTime = 0;                      // time of the last accepted edge in us
+    uint32_t bounceTime = 0;                    // time of the last dropped edge in us
+    uint32_t pressTime = 0;                     // time the button went down in us
+    uint32_t releaseTime = 0;                   // time the button went up in us
+    uint32_t decisionTime = 0;                  // time the last press type was decided in us
+
+    // -----------------------------------------------------------------------------------
+    // edge() method
+    //
+    // takes an edge, returns the press type it completes or -1
+    // -----------------------------------------------------------------------------------
+    int edge(uint32_t time, boolean down) {
+        if (down == pressed) {
+            return -1;
+        }
+        if (time - edgeTime < MINIMUMPULSE * 1000) {
+            bounced = true;
+            bounceTime = time;
+            return -1;
+        }
+        return accept(time, down);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // accept() method
+    //
+    // takes a debounced level change, returns the press type it completes or -1. A press
+    // shorter than MINIMUMPULSE is a glitch and is forgotten
+    // -----------------------------------------------------------------------------------
+    int accept(uint32_t time, boolean down) {
+        pressed = down;
+        bounced = false;
+        edgeTime = time;
+        if (down) {
+            if (state == RELEASED && time - releaseTime < SHORTPULSE * 1000) {
+                state = SECOND;
+                decisionTime = time;
+                return SpanButton::DOUBLE;
+            }
+            state = PRESSED;
+            pressTime = time;
+        } else {
+            state = state == PRESSED && time - pressTime >= MINIMUMPULSE * 1000 ? RELEASED : IDLE;
+            releaseTime = time;
+        }
+        return -1;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // expire() method
+    //
+    // checks the timeouts at a given time, returns the press type completed or -1
+    // -----------------------------------------------------------------------------------
+    int expire(uint32_t now) {
+        if (state == PRESSED && now - pressTime >= LONGPULSE * 1000) {
+            state = HELD;
+            decisionTime = pressTime + LONGPULSE * 1000;
+            return SpanButton::LONG;
+        }
+        if (state == RELEASED && now - releaseTime >= SHORTPULSE * 1000) {
+            state = IDLE;
+            decisionTime = releaseTime + SHORTPULSE * 1000;
+            return SpanButton::SINGLE;
+        }
+        return -1;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // settle() method
+    //
+    // once the bounce window is over takes the level the button settled to, in case the
+    // last edge was dropped as a bounce. Returns the press type completed or -1
+    // now              current time or time of the next edge in us
+    // down             level after the bounces
+    // -----------------------------------------------------------------------------------
+    int settle(uint32_t now, boolean down) {
+        if (!bounced || now - edgeTime < MINIMUMPULSE * 1000) {
+            return -1;
+        }
+        bounced = false;
+        return down == pressed ? -1 : accept(bounceTime, down);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // deadline() method
+    //
+    // returns the time of the next timeout or NO_DEADLINE
+    // -----------------------------------------------------------------------------------
+    uint32_t deadline() {
+        if (bounced) {
+            return edgeTime + MINIMUMPULSE * 1000;
+        }
+        if (state == PRESSED) {
+            return pressTime + LONGPULSE * 1000;
+        }
+        if (state == RELEASED) {
+            return releaseTime + SHORTPULSE * 1000;
+        }
+        return NO_DEADLINE;
+    }
+};
+
+// =====================================================================================
+// BUTTON_MANAGER: Captures the pushbutton edges from a GPIO interrupt, classifies the
+//                 presses and looks up the dispatch table when a press is completed
+//
+// The interrupt only timestamps the edge, queues it and wakes the lighting task, so
+// nothing polls the inputs and a busy loop() can no longer change the press type.
+// =====================================================================================
+struct BUTTON_MANAGER {
+
+    const uint8_t *pins = NULL;                 // input pins, from the wiring in flash
+    const uint16_t *first = NULL;               // first entry of each (pushbutton, press type)
+    const BUTTON_DISPATCH *entries = NULL;      // dispatch entries
+    int nButtons = 0;                           // pushbutton counter
+    PRESS_CLASSIFIER classifiers[MAX_BUTTONS];  // press state of each pushbutton
+    SPSC_QUEUE<BUTTON_EDGE, BUTTON_EDGE_QUEUE_SIZE> edges;     // GPIO interrupt -> lighting
+    TaskHandle_t notify = NULL;                 // task woken on every edge, NULL if none
+    uint32_t pressTime = 0;                     // time the press being dispatched was decided in us
+    volatile boolean wakeup = false;            // true once the pins wake the chip from light sleep
+    std::atomic<uint32_t> wakeTime{0};          // esp_timer us the pushbuttons last woke the chip from light sleep, 0 once taken
+    uint32_t wakeDelay[MAX_BUTTONS] = {};       // us from wake up to lighting side of the first edge of each press in progress
+    uint32_t pressWake = 0;                     // wakeDelay of the press being dispatched
+    uint32_t wakeBound = 0;                     // us a press may take from wake up to relay commit, 0 if unchecked
+    std::atomic<uint32_t> slowWakes{0};         // presses that took longer than wakeBound
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // takes the dispatch table and attaches the edge interrupt of every pushbutton
+    // -----------------------------------------------------------------------------------
+    template <int BUTTONS, int RULES>
+    void begin(const BUTTON_WIRING<BUTTONS, RULES> &wiring) {
+        static_assert(BUTTONS <= MAX_BUTTONS, "Too many pushbuttons, raise MAX_BUTTONS");
+        pins = wiring.pin;
+        first = wiring.first;
+        entries = wiring.entry;
+        for (int i = 0; i < BUTTONS; i++) {
+            pinMode(pins[i], INPUT_PULLUP);
+            classifiers[i].pressed = ReadButton(pins[i]);
+            attachInterruptArg(pins[i], onEdge, (void *) (intptr_t) i, CHANGE);
+        }
+        nButtons = BUTTONS;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // enableWakeup() method
+    //
+    // lets the pushbuttons wake the chip from light sleep, must be called after begin()
+    // -----------------------------------------------------------------------------------
+    void enableWakeup() {
+        for (int i = 0; i < nButtons; i++) {
+            ArmWakeup(pins[i], ReadButton(pins[i]));   // an edge right now raises the interrupt at once
+        }
+        wakeup = true;
+        esp_sleep_enable_gpio_wakeup();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // poll() method
+    //
+    // Classifies the captured edges and the expired timeouts, and dispatches completed
+    // presses. Called by the lighting engine, from its own task or from loop()
+    // handler          object with a press(const BUTTON_DISPATCH *entries, int n) method
+    // -----------------------------------------------------------------------------------
+    template <typename HANDLER>
+    void poll(HANDLER &handler) {
+        BUTTON_EDGE edge;
+        while (edges.pop(edge)) {
+            PRESS_CLASSIFIER &classifier = classifiers[edge.button];
+            uint32_t woke = wakeTime.load(std::memory_order_relaxed) != 0 ? wakeTime.exchange(0) : 0;
+            if (edge.pressed && classifier.deadline() == NO_DEADLINE) {
+                uint32_t start = woke != 0 && (int32_t) (edge.time - woke) >= 0 ? woke : edge.time;
+                wakeDelay[edge.button] = (uint32_t) esp_timer_get_time() - start;   // first edge of a press, the chip may have been asleep
+            }
+            classified(edge.button, classifier.settle(edge.time, !edge.pressed), handler);   // what happened before this edge goes first
+            classified(edge.button, classifier.expire(edge.time), handler);
+            classified(edge.button, classifier.edge(edge.time, edge.pressed), handler);
+        }
+        uint32_t now = (uint32_t) esp_timer_get_time();
+        for (int i = 0; i < nButtons; i++) {
+            classified(i, classifiers[i].settle(now, ReadButton(pins[i])), handler);
+            classified(i, classifiers[i].expire(now), handler);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // measureWake() method
+    //
+    // records the delay the controller added to the press being dispatched: from the
+    // wake up for its first edge (or the edge interrupt when awake) until the lighting
+    // side saw it, plus from the press decision until its outputs were committed. The
+    // time the press rules wait for the press type is not included
+    // commitTime       esp_timer time in us the scene of the press was committed
+    // -----------------------------------------------------------------------------------
+    void measureWake(uint32_t commitTime) {
+        uint32_t latency = pressWake + (commitTime - pressTime);
+        metrics.wakeLatency.record(latency);
+        if (wakeBound != 0 && latency > wakeBound) {
+            slowWakes.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // classified() method
+    //
+    // dispatches a press type returned by a classifier, -1 means no press
+    // -----------------------------------------------------------------------------------
+    template <typename HANDLER>
+    void classified(int button, int pressType, HANDLER &handler) {
+        if (pressType >= 0) {
+            pressTime = classifiers[button].decisionTime;
+            pressWake = wakeDelay[button];
+            dispatch(button, pressType, handler);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // idleTime() method
+    //
+    // returns the us poll() can wait for when no edge comes, NO_DEADLINE if forever
+    // -----------------------------------------------------------------------------------
+    uint32_t idleTime(uint32_t now) {
+        uint32_t wait = NO_DEADLINE;
+        for (int i = 0; i < nButtons; i++) {
+            uint32_t deadline = classifiers[i].deadline();
+            if (deadline != NO_DEADLINE) {
+                int32_t left = (int32_t) (deadline - now);
+                wait = left <= 0 ? 0 : ((uint32_t) left < wait ? (uint32_t) left : wait);
+            }
+        }
+        return wait;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // dispatch() method
+    //
+    // Runs the precomputed actions for a press on a pushbutton
+    // button           pushbutton index
+    // pressType        SpanButton::SINGLE, SpanButton::DOUBLE or SpanButton::LONG, anything
+    //                  else is ignored
+    // handler          object with a press(const BUTTON_DISPATCH *entries, int n) method
+    // -----------------------------------------------------------------------------------
+    template <typename HANDLER>
+    void dispatch(int button, int pressType, HANDLER &handler) {
+        if (button < 0 || button >= nButtons || pressType < 0 || pressType >= BUTTON_PRESS_TYPES) {
+            return;
+        }
+        int group = button * BUTTON_PRESS_TYPES + pressType;
+        TRACE(TRACE_PRESS, pins[button], pressType, first[group + 1] - first[group]);
+        handler.press(&entries[first[group]], first[group + 1] - first[group]);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // onEdge() method
+    //
+    // GPIO interrupt, queues the edge and wakes the lighting task
+    // -----------------------------------------------------------------------------------
+    static void ARDUINO_ISR_ATTR onEdge(void *arg);
+};
+
+BUTTON_MANAGER buttonManager;               // shared by all accessories
+
+void ARDUINO_ISR_ATTR BUTTON_MANAGER::onEdge(void *arg) {
+    int button = (intptr_t) arg;
+    BUTTON_EDGE edge = {(uint32_t) esp_timer_get_time(), (uint8_t) button, ReadButton(buttonManager.pins[button])};
+    if (buttonManager.wakeup) {
+        ArmWakeup(buttonManager.pins[button], edge.pressed);
+    }
+    if (!buttonManager.edges.push(edge)) {
+        metrics.droppedEdges.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (buttonManager.notify != NULL) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(buttonManager.notify, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+#endif
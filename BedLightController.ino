@@ -1,5 +1,6 @@
 #include "HomeSpan.h"        
 #include "DEV_LED.h"          
+#include "BENCHMARK.h"
 
 #define SWITCH_PIN_0 16                     // Pin for main room pushbutton
 #define SWITCH_PIN_1 17                     // Pin for side table #1 pushbutton 
@@ -19,12 +20,60 @@
 #define WEBLOG_BUFFER_SIZE 50
 #define DEFAULT_LOG_LEVEL 2
 
-// Accesories 
+#define LIGHTING_CORE 0                     // Core for the lighting task (loop() and HomeSpan run on core 1), LIGHTING_INLINE to run it from loop()
+
+// Accesories, in creation order. The order is the lamp id used by the pushbutton rules
+enum { CEILING_LAMP, READING_LAMP1, READING_LAMP2, STANDING_LAMP, HEADBOARD_LAMP, LAMP_COUNT };
 DEV_LED *ceilingLamp, *readingLamp1, *readingLamp2, *standingLamp;
 DEV_RgbLED *ledStripe;
 
+// PWM outputs of the headboard strip: red, green and blue anodes
+constexpr int headboardPins[] = { HEADBOARD_LAMP_RED_ANODE_PIN, HEADBOARD_LAMP_GREEN_ANODE_PIN, HEADBOARD_LAMP_BLUE_ANODE_PIN };
+
+// Pushbuttons
+constexpr int pushbuttons[] = { SWITCH_PIN_0, SWITCH_PIN_1, SWITCH_PIN_2 };
+
+// What each lamp does on each pushbutton, a lamp without a rule for a pushbutton ignores it
+constexpr BUTTON_RULE buttonRules[] = {
+    // lamp           pushbutton     long  single   double
+    { CEILING_LAMP,   SWITCH_PIN_0,  OFF,  TOGGLE,  OFF     },  // Long press on SWITCH_PIN_0 makes accessory off, normal press makes accesory toggle status,
+                                                                // double click makes accesory goes off
+    { CEILING_LAMP,   SWITCH_PIN_1,  OFF,  NOTHING, NOTHING },  // Long press on SWITCH_PIN_1 makes accessory off, normal press and double click do not have
+                                                                // effect on accesory
+    { CEILING_LAMP,   SWITCH_PIN_2,  OFF,  NOTHING, NOTHING },  // Long press on SWITCH_PIN_2 makes accessory off, normal press and double click do not have
+                                                                // effect on accesory
+    { READING_LAMP1,  SWITCH_PIN_0,  OFF,  NOTHING, TOGGLE  },  // Long press on SWITCH_PIN_0 makes accessory off, normal press does nothing, double click
+                                                                // makes accesory toggle status
+    { READING_LAMP1,  SWITCH_PIN_1,  OFF,  TOGGLE,  NOTHING },  // Long press on SWITCH_PIN_1 makes accessory off, normal press makes accesory toggle status
+    { READING_LAMP1,  SWITCH_PIN_2,  OFF,  NOTHING, NOTHING },  // Long press on SWITCH_PIN_2 makes accessory off
+    { READING_LAMP2,  SWITCH_PIN_0,  OFF,  NOTHING, TOGGLE  },  // Long press on SWITCH_PIN_0 makes accessory off, normal press does nothing, double click
+                                                                // makes accesory toggle status
+    { READING_LAMP2,  SWITCH_PIN_1,  OFF,  NOTHING, NOTHING },  // Long press on SWITCH_PIN_1 makes accessory off
+    { READING_LAMP2,  SWITCH_PIN_2,  OFF,  TOGGLE,  NOTHING },  // Long press on SWITCH_PIN_2 makes accessory off, normal press makes accesory toggle status
+    { STANDING_LAMP,  SWITCH_PIN_0,  OFF,  NOTHING, TOGGLE  },  // Long press on any pushbutton makes accessory off, double click makes accesory toggle status
+    { STANDING_LAMP,  SWITCH_PIN_1,  OFF,  NOTHING, TOGGLE  },
+    { STANDING_LAMP,  SWITCH_PIN_2,  OFF,  NOTHING, TOGGLE  },
+    { HEADBOARD_LAMP, SWITCH_PIN_0,  OFF,  NOTHING, NOTHING },  // Long press on any pushbutton makes accessory off, normal and double clic do nothing
+    { HEADBOARD_LAMP, SWITCH_PIN_1,  OFF,  NOTHING, NOTHING },
+    { HEADBOARD_LAMP, SWITCH_PIN_2,  OFF,  NOTHING, NOTHING },
+};
+
+static_assert(UniquePushbuttons(pushbuttons), "A pin is listed twice as pushbutton");
+static_assert(ValidButtonRules(pushbuttons, buttonRules, LAMP_COUNT), "A pushbutton rule uses an unknown pin, lamp or action");
+static_assert(UniqueButtonRules(buttonRules), "A lamp has two rules for the same pushbutton");
+
+constexpr auto buttonWiring = MakeButtonWiring(pushbuttons, buttonRules);    // Dispatch table, generated at compile time into flash
+
 
 void setup() {                
+
+    // Fast boot: outputs are driven to their saved state before Serial, WiFi and HomeKit
+    stateStore.begin();
+    lighting.addRelayLamp(CEILING_LAMP_PIN, LOW);                 // Lamps in the accessory order, normally closed relays are on with LOW
+    lighting.addRelayLamp(READING_LAMP1_PIN, LOW);
+    lighting.addRelayLamp(READING_LAMP2_PIN, LOW);
+    lighting.addRelayLamp(STANDING_LAMP_PIN, LOW);
+    lighting.addPwmLamp(headboardPins, true);                     // Anodes are driven, so outputs are inverted
  
     Serial.begin(115200);       
 
@@ -33,60 +82,45 @@ void setup() {
     homeSpan.setStatusPin(STATUS_LED_PIN);
     homeSpan.setLogLevel(DEFAULT_LOG_LEVEL);
     homeSpan.enableWebLog(WEBLOG_BUFFER_SIZE,"pool.ntp.org","UTC","log");
+    trace.begin();                                                // 't' on Serial and the "log" page dump the lighting trace
+    benchmark.begin();                                            // 'b' on Serial benchmarks the pushbutton and HomeKit paths
+    metrics.begin();                                              // Prometheus metrics on port METRICS_PORT once WiFi is up
 
     homeSpan.begin(Category::Bridges,"Bedroom lighting controller"); 
 
     SPAN_ACCESSORY()                                              // More than 3 accesories requires add bridge accesory an delect Bridges as category
 
     SPAN_ACCESSORY("Ceiling lamp")
-    ceilingLamp = new DEV_LED(CEILING_LAMP_PIN, "Ceiling Lamp");                // Creates accessory with activity on pin CEILING_LAMP_PIN
-    ceilingLamp->setActionsOnSpanButton(SWITCH_PIN_0, OFF, TOGGLE, OFF);        // Long press on SWITCH_PIN_0 makes accessory off, normal press makes 
-                                                                                // accesory toggle status, double click makes accesory goes off
-    ceilingLamp->setActionsOnSpanButton(SWITCH_PIN_1, OFF, NOTHING, NOTHING);   // Long press on SWITCH_PIN_1 makes accessory off, normal press does not
-                                                                                // have effect on accesory, double click makes accesory going off
-    ceilingLamp->setActionsOnSpanButton(SWITCH_PIN_2, OFF, NOTHING, NOTHING);   // Long press on SWITCH_PIN_2 makes accessory off, normal press does not
-                                                                                // have effect on accesory, double click makes accesory going off
+    ceilingLamp = new DEV_LED(&lighting.lamps[CEILING_LAMP], "Ceiling Lamp");         // Creates accessory with activity on pin CEILING_LAMP_PIN
 
     SPAN_ACCESSORY("#1 Reading lamp")
-    readingLamp1 = new DEV_LED(READING_LAMP1_PIN, "#1 Reading lamp");           // Creates accessory with activity on pin READING_LAMP1_PIN
-    readingLamp1->setActionsOnSpanButton(SWITCH_PIN_0, OFF, NOTHING, TOGGLE);   // Long press on SWITCH_PIN_0 makes accessory off, normal press does 
-                                                                                // nothing, double click makes accesory going on
-    readingLamp1->setActionsOnSpanButton(SWITCH_PIN_1, OFF, TOGGLE, NOTHING);   // Long press on SWITCH_PIN_1 makes accessory off, normal press makes 
-                                                                                // accesory toggle status, double click makes accesory going off
-    readingLamp1->setActionsOnSpanButton(SWITCH_PIN_2, OFF, NOTHING, NOTHING);  // Long press on SWITCH_PIN_2 makes accessory off, normal press does 
-                                                                                // nothing on accesory, double click makes accesory going off
+    readingLamp1 = new DEV_LED(&lighting.lamps[READING_LAMP1], "#1 Reading lamp");    // Creates accessory with activity on pin READING_LAMP1_PIN
 
     SPAN_ACCESSORY("#2 Reading lamp")
-    readingLamp2 = new DEV_LED(READING_LAMP2_PIN, "#2 Reading lamp");           // Creates accessory with activity on pin READING_LAMP2_PIN
-    readingLamp2->setActionsOnSpanButton(SWITCH_PIN_0, OFF, NOTHING, TOGGLE);   // Long press on SWITCH_PIN_0 makes accessory off, normal press does 
-                                                                                // nothing, double click makes accesory going on
-    readingLamp2->setActionsOnSpanButton(SWITCH_PIN_1, OFF, NOTHING, NOTHING);  // Long press on SWITCH_PIN_1 makes accessory off, normal press does 
-                                                                                // nothing on accesory, double click makes accesory going off
-    readingLamp2->setActionsOnSpanButton(SWITCH_PIN_2, OFF, TOGGLE, NOTHING);   // Long press on SWITCH_PIN_2 makes accessory off, normal press makes 
-                                                                                // accesory toggle status, double click makes accesory going off
+    readingLamp2 = new DEV_LED(&lighting.lamps[READING_LAMP2], "#2 Reading lamp");    // Creates accessory with activity on pin READING_LAMP2_PIN
 
     SPAN_ACCESSORY("Standing lamp")
-    standingLamp = new DEV_LED(STANDING_LAMP_PIN, "Standing lamp");             // Creates accessory with activity on pin STANDING_LAMP_PIN
-    standingLamp->setActionsOnSpanButton(SWITCH_PIN_0, OFF, NOTHING, TOGGLE);   // Long press on SWITCH_PIN_0 makes accessory off, normal press does 
-                                                                                // nothing, double click makes accesory going on
-    standingLamp->setActionsOnSpanButton(SWITCH_PIN_1, OFF, NOTHING, TOGGLE);   // Long press on SWITCH_PIN_1 makes accessory off, normal press makes 
-                                                                                // accesory toggle status, double click makes accesory toggle status
-    standingLamp->setActionsOnSpanButton(SWITCH_PIN_2, OFF, NOTHING, TOGGLE);   // Long press on SWITCH_PIN_2 makes accessory off, normal press makes 
-                                                                                // accesory toggle status, double click makes accesory toggle status
+    standingLamp = new DEV_LED(&lighting.lamps[STANDING_LAMP], "Standing lamp");      // Creates accessory with activity on pin STANDING_LAMP_PIN
 
     SPAN_ACCESSORY("Headboard lamp")
-    ledStripe = new DEV_RgbLED(HEADBOARD_LAMP_RED_ANODE_PIN, HEADBOARD_LAMP_GREEN_ANODE_PIN, 
-                               HEADBOARD_LAMP_BLUE_ANODE_PIN, "Headboard lamp");  // Creates accessory with activity on pin STANDING_LAMP_PIN
-    ledStripe->setActionsOnSpanButton(SWITCH_PIN_0, OFF, NOTHING, NOTHING);       // Long press on SWITCH_PIN_0 makes accessory off, normal and double clic 
-                                                                                  // do nothing
-    ledStripe->setActionsOnSpanButton(SWITCH_PIN_1, OFF, NOTHING, NOTHING);       // Long press on SWITCH_PIN_1 makes accessory off, normal and double clic 
-                                                                                  // do nothing
-    ledStripe->setActionsOnSpanButton(SWITCH_PIN_2, OFF, NOTHING, NOTHING);       // Long press on SWITCH_PIN_2 makes accessory off, normal and double clic 
-                                                                                  // do nothing
+    ledStripe = new DEV_RgbLED(&lighting.lamps[HEADBOARD_LAMP], "Headboard lamp");    // Creates accessory with activity on the HEADBOARD_LAMP pins
+    for (int i = 0; i < EFFECT_COUNT; i++) {
+        new DEV_EffectSwitch(ledStripe, i);                                       // Sunrise, circadian and night light effects of the headboard
+    }
+
+    lighting.begin(LIGHTING_CORE, buttonWiring);                                  // From now on outputs and pushbuttons are owned by the lighting engine
+    powerManager.begin();                                                         // Modem or light sleep when idle, pushbuttons wake the controller
 }
 
 void loop() {
-  homeSpan.poll();         // run HomeSpan!
+  {
+    SCOPED_TIMER timer(metrics.loopTime);   // loop() iteration time, without the idle wait
+    homeSpan.poll();         // run HomeSpan!
+    lighting.loop();         // brings HomeKit in line with pushbutton changes done by the lighting engine
+    metrics.loop();          // serves the metrics page
+    benchmark.loop();        // plays the slider drag of a running benchmark
+  }
+  powerManager.idle();       // waits when there is nothing to do
 } 
 
  
\ No newline at end of file
@@ -0,0 +1,204 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+// Fixed point colour kernel. Every intensity is a 16 bit unsigned value where 0 is off
+// and DUTY_MAX is full on. Lookup tables are generated by the compiler and live in flash.
+
+#define DUTY_BITS 16
+#define DUTY_MAX 65535
+#define GAMMA_STEPS 256             // gamma table segments, output is interpolated between them
+#define MIRED_COOL 140              // HomeKit colour temperature range, coolest white
+#define MIRED_WARM 500              // warmest white
+
+// =====================================================================================
+// HSV_COLOR: Colour as managed by HomeKit, stored in integer units
+// =====================================================================================
+struct HSV_COLOR {
+
+    uint16_t h;                                 // hue [0,360]
+    uint8_t s;                                  // saturation [0,100] in percent
+    uint8_t v;                                  // brightness [0,100] in percent, 0 means off
+
+    // -----------------------------------------------------------------------------------
+    // set() method
+    //
+    // stores a colour clamping every component to its valid range
+    // -----------------------------------------------------------------------------------
+    void set(float hue, float saturation, float brightness) {
+        h = hue < 0 ? 0 : (hue > 360 ? 360 : (uint16_t) hue);
+        s = saturation < 0 ? 0 : (saturation > 100 ? 100 : (uint8_t) saturation);
+        v = brightness < 0 ? 0 : (brightness > 100 ? 100 : (uint8_t) brightness);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // set() method
+    //
+    // same as above from integer units, no float so it can be used in critical sections
+    // -----------------------------------------------------------------------------------
+    void set(uint16_t hue, uint8_t saturation, uint8_t brightness) {
+        h = hue > 360 ? 360 : hue;
+        s = saturation > 100 ? 100 : saturation;
+        v = brightness > 100 ? 100 : brightness;
+    }
+};
+
+// =====================================================================================
+// RGB_DUTY: Full resolution intensity for each channel of a RGB output
+// =====================================================================================
+struct RGB_DUTY {
+    uint16_t r, g, b;
+};
+
+// =====================================================================================
+// GAMMA_TABLE: CIE 1931 lightness to luminance curve, GAMMA_STEPS + 1 points
+//
+// L = 100 * i / GAMMA_STEPS
+// Y = L / 903.3                 when L <= 8
+// Y = ((L + 16) / 116) ^ 3      otherwise
+// =====================================================================================
+struct GAMMA_TABLE {
+
+    uint16_t value[GAMMA_STEPS + 1];
+
+    constexpr GAMMA_TABLE() : value() {
+        for (uint32_t i = 0; i <= GAMMA_STEPS; i++) {
+            if (i * 100 <= 8 * GAMMA_STEPS) {
+                value[i] = (uint16_t) (((uint64_t) i * 100 * DUTY_MAX * 10 + GAMMA_STEPS * 9033 / 2) / ((uint64_t) GAMMA_STEPS * 9033));
+            } else {
+                uint64_t l = i * 100 + 16 * GAMMA_STEPS;            // (L + 16) scaled by GAMMA_STEPS
+                uint64_t d = 116 * GAMMA_STEPS;
+                value[i] = (uint16_t) ((l * l * l * DUTY_MAX + d * d * d / 2) / (d * d * d));
+            }
+        }
+    }
+};
+
+// =====================================================================================
+// HUE_TABLE: Sector [0,5] and position inside the sector for every integer hue [0,360]
+// =====================================================================================
+struct HUE_TABLE {
+
+    uint8_t sector[361];
+    uint16_t fraction[361];                     // position inside the sector, DUTY_MAX at the end
+
+    constexpr HUE_TABLE() : sector(), fraction() {
+        for (uint32_t h = 0; h <= 360; h++) {
+            sector[h] = (h % 360) / 60;
+            fraction[h] = (uint16_t) ((h % 60) * DUTY_MAX / 60);
+        }
+    }
+};
+
+static constexpr GAMMA_TABLE gammaTable;
+static constexpr HUE_TABLE hueTable;
+
+// ---------------------------------------------------------------------------------------
+// Gamma() method
+//
+// returns the perceptually corrected intensity
+// linear         intensity [0,DUTY_MAX]
+// ---------------------------------------------------------------------------------------
+inline uint16_t Gamma(uint16_t linear) {
+    uint32_t i = linear >> (DUTY_BITS - 8);                         // GAMMA_STEPS == 256
+    uint32_t f = linear & 0xFF;
+    uint32_t a = gammaTable.value[i];
+    uint32_t b = gammaTable.value[i + 1];
+    return (uint16_t) (a + ((b - a) * f) / 0xFF);                   // 0xFF so DUTY_MAX is full on
+}
+
+// ---------------------------------------------------------------------------------------
+// Percent2Duty() method
+//
+// returns the [0,DUTY_MAX] intensity for a [0,100] percent value
+// ---------------------------------------------------------------------------------------
+inline uint16_t Percent2Duty(uint32_t percent) {
+    return percent >= 100 ? DUTY_MAX : (uint16_t) ((percent * DUTY_MAX + 50) / 100);
+}
+
+// ---------------------------------------------------------------------------------------
+// Duty2Percent() method
+//
+// returns the percent value expected by LedPin::set() keeping the full duty resolution,
+// LedPin scales it back to the bits supported by its LEDC timer
+// ---------------------------------------------------------------------------------------
+inline float Duty2Percent(uint16_t duty) {
+    return duty * (100.0f / DUTY_MAX);
+}
+
+// ---------------------------------------------------------------------------------------
+// HSVtoDuty() method
+//
+// integer replacement of LedPin::HSVtoRGB(), returns gamma corrected duties
+// color          hue [0,360], saturation and brightness [0,100]
+// duty           output intensities [0,DUTY_MAX]
+// ---------------------------------------------------------------------------------------
+inline void HSVtoDuty(const HSV_COLOR &color, RGB_DUTY &duty) {
+
+    uint32_t v = Percent2Duty(color.v);
+    uint32_t s = Percent2Duty(color.s);
+    uint32_t h = color.h > 360 ? 360 : color.h;
+    uint32_t f = hueTable.fraction[h];
+
+    uint32_t vs = (v * s) / DUTY_MAX;
+    uint32_t p = v - vs;                                            // v * (1 - s)
+    uint32_t q = v - (vs * f) / DUTY_MAX;                           // v * (1 - s * f)
+    uint32_t t = v - (vs * (DUTY_MAX - f)) / DUTY_MAX;              // v * (1 - s * (1 - f))
+
+    uint32_t r, g, b;
+    switch (hueTable.sector[h]) {
+        case 0:  r = v; g = t; b = p; break;
+        case 1:  r = q; g = v; b = p; break;
+        case 2:  r = p; g = v; b = t; break;
+        case 3:  r = p; g = q; b = v; break;
+        case 4:  r = t; g = p; b = v; break;
+        default: r = v; g = p; b = q; break;
+    }
+
+    duty.r = Gamma(r);
+    duty.g = Gamma(g);
+    duty.b = Gamma(b);
+}
+
+// ---------------------------------------------------------------------------------------
+// BrightnessToDuty() method
+//
+// returns the gamma corrected duty for a [0,100] percent brightness
+// ---------------------------------------------------------------------------------------
+inline uint16_t BrightnessToDuty(uint32_t percent) {
+    return Gamma(Percent2Duty(percent));
+}
+
+// ---------------------------------------------------------------------------------------
+// CCTtoDuty() method
+//
+// splits a brightness between a warm and a cool white channel, the sum of both is the
+// gamma corrected brightness at any temperature
+// mired          colour temperature [MIRED_COOL,MIRED_WARM]
+// percent        brightness [0,100]
+// warm, cool     output intensities [0,DUTY_MAX]
+// ---------------------------------------------------------------------------------------
+inline void CCTtoDuty(uint32_t mired, uint32_t percent, uint16_t &warm, uint16_t &cool) {
+    mired = mired < MIRED_COOL ? MIRED_COOL : (mired > MIRED_WARM ? MIRED_WARM : mired);
+    uint32_t total = BrightnessToDuty(percent);
+    warm = (uint16_t) (total * (mired - MIRED_COOL) / (MIRED_WARM - MIRED_COOL));
+    cool = (uint16_t) (total - warm);
+}
+
+// ---------------------------------------------------------------------------------------
+// ExtractWhite() method
+//
+// moves the part common to red, green and blue to a white channel. Duties are linear
+// light, so the subtraction keeps the colour
+// duty           red, green and blue intensities, reduced by the white part
+// returns        white intensity [0,DUTY_MAX]
+// ---------------------------------------------------------------------------------------
+inline uint16_t ExtractWhite(RGB_DUTY &duty) {
+    uint16_t w = duty.r < duty.g ? duty.r : duty.g;
+    w = w < duty.b ? w : duty.b;
+    duty.r -= w;
+    duty.g -= w;
+    duty.b -= w;
+    return w;
+}
+
+#endif
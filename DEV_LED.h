@@ -1,434 +1,340 @@
+#ifndef DEV_LED_H
+#define DEV_LED_H
+
 #include "extras/PwmPin.h"  // NEW! Include this HomeSpan "extra" to create LED-compatible PWM signals on one or more pinsn
 #include "UTILS.h"
-
-// Redefine time for button actions
-#define LONGPULSE 1200
-#define MINIMUMPULSE 10
-#define SHORTPULSE 300
-
-// Action definitions for pushbuttons
-#define NOTHING -1
-#define OFF 0
-#define ON 1
-#define TOGGLE 2
-
-#define MAX_PUSHBUTTONS 3
-
-// =====================================================================================
-// BUTTON_ACTION: Class for manage button action configuration
-// =====================================================================================
-struct BUTTON_ACTION {
-
-    int controlPin;                                    // pin associated for the input pin that control this device by hardware
-    int actionOnLong, actionOnSingle, actionOnDouble;  // action type for each type of button press
-
-    // -----------------------------------------------------------------------------------
-    // constructor() method
-    //
-    // controlPin       reference for the input button pin assigned for the class instance
-    // actionOnLong     action to be done on long press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnSingle   action to be done on normal press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnDouble   action to be done on quick double click press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // -----------------------------------------------------------------------------------
-    BUTTON_ACTION(int controlPin, int actionOnLong, int actionOnSingle, int actionOnDouble) {
-
-        this->controlPin = controlPin;
-        this->actionOnLong = actionOnLong;
-        this->actionOnSingle = actionOnSingle;
-        this->actionOnDouble = actionOnDouble;
-    }
-};
-
-// ---------------------------------------------------------------------------------------
-// Action2Name() method
-//
-// returns action name
-// action         Action id
-// ---------------------------------------------------------------------------------------
-const char *Action2Name(int action) {
-    return ((action == ON ? "Turns ON" : (action == OFF ? "Turns OFF" : (action == TOGGLE ? "Toggles ON or OFF" : "Does nothing"))));
-
-} 
+#include "BUTTON_MANAGER.h"
+#include "COLOR.h"
+#include "FADER.h"
+#include "LIGHTING.h"
+#include "TRACE.h"
+#include "METRICS.h"
+#include "EFFECTS.h"
 
 
 // =====================================================================================
 // DEV_LED: Class for manage on/off light type devices
 // =====================================================================================
-struct DEV_LED : Service::LightBulb {  // ON/OFF LED
+struct DEV_LED : Service::LightBulb, LAMP_ACCESSORY {  // ON/OFF LED
 
     int ledPin;                                 // pin number defined for this LED
     SpanCharacteristic *power;                  // reference to the On Characteristic
-    int actions = 0;                            // pushbutton counter
-    BUTTON_ACTION *action[MAX_PUSHBUTTONS];     // rules for pushbuttons
-    char *accessoryName;                        // accessory name just for login purpose
+    LAMP *lamp;                                 // output owned by the lighting engine
 
     // -----------------------------------------------------------------------------------
     // constructor() method
     //
-    // ledPin           reference for the output pin assigned for the class instance
+    // lamp             relay lamp created at boot by lighting.addRelayLamp(), its output is
+    //                  already showing the saved state
     // -----------------------------------------------------------------------------------
-    DEV_LED(int ledPin, char *name): Service::LightBulb() {
-        this->actions = 0;  // Initialize as no actions
-        power = new Characteristic::On();
-        power->setVal(0);
-        this->ledPin = ledPin;
+    DEV_LED(LAMP *lamp, char *name): Service::LightBulb() {
+        power = new Characteristic::On(lamp->power);
+        this->ledPin = lamp->relayPin;
         this->accessoryName = name;
-        pinMode(ledPin, OUTPUT);  // Only required for on/off pins
-        //digitalWrite(ledPin, 1); // As quick as possible to set up to avoid flicking
+        this->lamp = lamp;
+        lamp->accessory = this;
         update();
     }
 
-    // -----------------------------------------------------------------------------------
-    // setActionsOnSpanButton() method
-    //
-    // Attachs action configuration to a specific pin
-    //
-    // controlPin       reference for the input button pin assigned for the class instance
-    // actionOnLong     action to be done on long press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnSingle   action to be done on normal press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnDouble   action to be done on quick double click press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // -----------------------------------------------------------------------------------
-    boolean setActionsOnSpanButton(int controlPin, int actionOnLong, int actionOnSingle, int actionOnDouble) {
-
-        if (actions == MAX_PUSHBUTTONS) {
-            return false;                   // Only MAX_PUSHBUTTONS actions supported per accesory
-        }
-        WEBLOG("Configuring ON/OFF lamp for accessory %s[Pin#%d] with control pushbutton on pin %d and index #%d", accessoryName, ledPin, controlPin, actions);
-        WEBLOG("      %s on normal click", Action2Name(actionOnSingle));
-        WEBLOG("      %s on double click", Action2Name(actionOnDouble));
-        WEBLOG("      %s on long press", Action2Name(actionOnLong));
-        new SpanButton(controlPin, LONGPULSE, MINIMUMPULSE, SHORTPULSE);
-        this->action[actions] = new BUTTON_ACTION(controlPin, actionOnLong, actionOnSingle, actionOnDouble);
-        this->actions++;
-        return true;
-    }
-
     // -----------------------------------------------------------------------------------
     // update() method
     //
     // updates hardware pin status.
-    // Note that since library manages normally closed relay Ive changed to 1 - val()
+    // Note that since library manages normally closed relay the lamp is on with a LOW level
     // -----------------------------------------------------------------------------------
     boolean update() {
-        digitalWrite(ledPin, 1 - power->getNewVal());
+        SCOPED_TIMER timer(metrics.updateTime[DEVICE_LED]);
+        lighting.set(lamp, power->getNewVal(), NULL, NULL);
         return true;  // returns true
     }
 
     // -----------------------------------------------------------------------------------
-    // button() method
+    // syncPower() method
     //
-    // handles clic on button. Library pass button pin id and press type so its responsability
-    // of the handler to decide what to do with the button an press type
+    // follows a change done by a pushbutton
     // -----------------------------------------------------------------------------------
-    void button(int pin, int pressType) override {
-
-        LOG2("Accessory %s Pin #%d button handler got button press on pin %d with type %s\n", accessoryName, ledPin, pin, pressType == SpanButton::LONG ? "LONG" : (pressType == SpanButton::SINGLE ? "SINGLE" : (pressType == SpanButton::DOUBLE ? "DOUBLE" : "???")));
-        for (int i = 0; i < this->actions; i++) {
-            LOG2("   Pushbutton index #%d ", i);
-            if (pin == action[i]->controlPin) {
-                LOG2("configured for pin #%d ", pin);
-                int a = ((pressType == SpanButton::SINGLE) ? action[i]->actionOnSingle : ((pressType == SpanButton::DOUBLE) ? action[i]->actionOnDouble : ((pressType == SpanButton::LONG) ? action[i]->actionOnLong : NOTHING)));
-                LOG2("with action: #%s\n", Action2Name(a));
-                if(a == NOTHING) {
-                    LOG2("      Nothing to do\n");
-                } else {
-                    if(a == OFF) {
-                        power->setVal(0);
-                        LOG2("      Accessory going OFF\n");
-                    } else {
-                        if(a == TOGGLE) {
-                            power->setVal(1 - power->getVal());
-                            LOG2("      Accessory going %s\n", power->getVal() == 0 ? "ON" : "OFF");
-                        } else {
-                            power->setVal(1);
-                            LOG2("      Accessory going ON\n");
-                        }
-                    }
-                    update();
-                    LOG2("      Updating...\n");
-                }
-                LOG2("   Exit handler\n");
-                return;
-            } else {
-                LOG2("not configured for pin #%d \n", pin);
-            }
-        }
-        LOG2("   Exit handler\n");
+    void syncPower(boolean power) override {
+        this->power->setVal(power);
     }
 };
 
 // =====================================================================================
-// DEV_DimmableLED: Class for manage dimmable light type devices (PWM based)
+// Colour models for DEV_PwmLED
+//
+// Every model gives the PWM channels it drives, the characteristics it adds to the light
+// bulb and how their values are mixed into channel duties, in fixed point. CHANNELS and
+// VALUES are compile time constants so the loops of DEV_PwmLED unroll. HSV models take
+// hue, saturation and brightness, the values of the effect keyframes.
 // =====================================================================================
-struct DEV_DimmableLED : Service::LightBulb {  // Dimmable LED
 
-    LedPin *ledPin;                             // NEW! Create reference to LED Pin instantiated below
-    SpanCharacteristic *power;                  // reference to the On Characteristic
-    SpanCharacteristic *level;                  // NEW! Create a reference to the Brightness Characteristic instantiated below
-    int actions = 0;                            // pushbutton counter
-    BUTTON_ACTION *action[MAX_PUSHBUTTONS];     // rules for pushbuttons
-    char *accessoryName;                        // accessory name just for login purpose
+// Single channel dimmable white: brightness
+struct MONO_MODEL {
+    static constexpr int CHANNELS = 1;
+    static constexpr int VALUES = 1;
+    static constexpr int DEVICE = DEVICE_DIMMABLE_LED;
+    static constexpr boolean HSV = false;
 
+    static void create(SpanCharacteristic **values, const uint16_t *saved) {
+        values[0] = new Characteristic::Brightness(saved != NULL ? saved[0] : 50);  // saved value or 50%
+        values[0]->setRange(5, 100, 1);
+    }
 
-    // -----------------------------------------------------------------------------------
-    // constructor() method
-    //
-    // pin              reference for the output pin assigned for the class instance
-    // -----------------------------------------------------------------------------------
-    DEV_DimmableLED(int pin, char *name) : Service::LightBulb() {  // constructor() method
-        power = new Characteristic::On();
-        level = new Characteristic::Brightness(50);  // NEW! Instantiate the Brightness Characteristic with an initial value of 50% (same as we did in Example 4)
-        level->setRange(5, 100, 1);                  // NEW! This sets the range of the Brightness to be from a min of 5%, to a max of 100%, in steps of 1% (different from Example 4 values)
-        this->ledPin = new LedPin(pin);              // NEW! Configures a PWM LED for output to the specified pin.  Note pinMode() does NOT need to be called in advance
-        this->accessoryName = name;
-        update();
-    }  // end constructor
+    static void mix(const uint16_t *value, uint16_t *duty) {
+        duty[0] = BrightnessToDuty(value[0]);
+    }
+};
 
-    // -----------------------------------------------------------------------------------
-    // update() method
-    //
-    // updates hardware pin status.
-    // -----------------------------------------------------------------------------------
-    boolean update() {  // update() method
-        ledPin->set(power->getNewVal() * level->getNewVal());
-        return true;  // return true
+// Tunable white, warm and cool channels: brightness, colour temperature
+struct CCT_MODEL {
+    static constexpr int CHANNELS = 2;
+    static constexpr int VALUES = 2;
+    static constexpr int DEVICE = DEVICE_CCT_LED;
+    static constexpr boolean HSV = false;
+
+    static void create(SpanCharacteristic **values, const uint16_t *saved) {
+        values[0] = new Characteristic::Brightness(saved != NULL ? saved[0] : 100);
+        values[0]->setRange(5, 100, 1);
+        values[1] = new Characteristic::ColorTemperature(saved != NULL ? saved[1] : (MIRED_COOL + MIRED_WARM) / 2);
+        values[1]->setRange(MIRED_COOL, MIRED_WARM, 1);
     }
 
-    // -----------------------------------------------------------------------------------
-    // setActionsOnSpanButton() method
-    //
-    // Attachs action configuration to a specific pin
-    //
-    // controlPin       reference for the input button pin assigned for the class instance
-    // actionOnLong     action to be done on long press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnSingle   action to be done on normal press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnDouble   action to be done on quick double click press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // -----------------------------------------------------------------------------------
-    boolean setActionsOnSpanButton(int controlPin, int actionOnLong, int actionOnSingle, int actionOnDouble) {
+    static void mix(const uint16_t *value, uint16_t *duty) {
+        CCTtoDuty(value[1], value[0], duty[0], duty[1]);
+    }
+};
 
-        if (actions == MAX_PUSHBUTTONS) {
-            return false;                   // Only MAX_PUSHBUTTONS actions supported per accesory
-        }
-        WEBLOG("Configuring ON/OFF dimmable lamp for accessory %s[Pin#%d] with control pushbutton on pin %d and index #%d", accessoryName, ledPin->getPin(), controlPin, actions);
-        WEBLOG("      %s on normal click", Action2Name(actionOnSingle));
-        WEBLOG("      %s on double click", Action2Name(actionOnDouble));
-        WEBLOG("      %s on long press", Action2Name(actionOnLong));
-        new SpanButton(controlPin, LONGPULSE, MINIMUMPULSE, SHORTPULSE);
-        this->action[actions] = new BUTTON_ACTION(controlPin, actionOnLong, actionOnSingle, actionOnDouble);
-        actions++;
-        return true;
+// Red, green and blue channels: hue, saturation, brightness
+struct RGB_MODEL {
+    static constexpr int CHANNELS = 3;
+    static constexpr int VALUES = 3;
+    static constexpr int DEVICE = DEVICE_RGB_LED;
+    static constexpr boolean HSV = true;
+
+    static void create(SpanCharacteristic **values, const uint16_t *saved) {
+        values[0] = new Characteristic::Hue(saved != NULL ? saved[0] : 0);             // saved value or 0 out of 360
+        values[1] = new Characteristic::Saturation(saved != NULL ? saved[1] : 0);      // saved value or 0%
+        values[2] = new Characteristic::Brightness(saved != NULL ? saved[2] : 100);    // saved value or 100%
+        values[2]->setRange(5, 100, 1);
     }
 
-    // -----------------------------------------------------------------------------------
-    // button() method
-    //
-    // handles clic on button. Library pass button pin id and press type so its responsability
-    // of the handler to decide what to do with the button an press type
-    // TODO: review power and level set values
-    // -----------------------------------------------------------------------------------
-    void button(int pin, int pressType) override {
-
-        LOG2("Accessory %s Pin #%d button handler got button press on pin %d with type %s\n", accessoryName, ledPin, pin, pressType == SpanButton::LONG ? "LONG" : (pressType == SpanButton::SINGLE ? "SINGLE" : (pressType == SpanButton::DOUBLE ? "DOUBLE" : "???")));
-        for (int i = 0; i < this->actions; i++) {
-            LOG2("   Pushbutton index #%d ", i);
-            if (pin == action[i]->controlPin) {
-                LOG2("configured for pin #%d ", pin);
-                int a = ((pressType == SpanButton::SINGLE) ? action[i]->actionOnSingle : ((pressType == SpanButton::DOUBLE) ? action[i]->actionOnDouble : ((pressType == SpanButton::LONG) ? action[i]->actionOnLong : NOTHING)));
-                LOG2("with action: #%s\n", Action2Name(a));
-                if(a == NOTHING) {
-                    LOG2("      Nothing to do\n");
-                } else {
-                    if(a == OFF) {
-                        power->setVal(0);
-                        LOG2("      Accessory going OFF\n");
-                    } else {
-                        if(a == TOGGLE) {
-                            power->setVal(1 - power->getVal());
-                            LOG2("      Accessory going %s\n", power->getVal() == 0 ? "ON" : "OFF");
-                        } else {
-                            power->setVal(1);
-                            LOG2("      Accessory going ON\n");
-                        }
-                    }
-                    update();
-                    LOG2("      Updating...\n");
-                }
-                LOG2("   Exit handler\n");
-                return;
-            } else {
-                LOG2("not configured for pin #%d \n", pin);
-            }
-        }
-        LOG2("   Exit handler\n");
+    static void mix(const uint16_t *value, uint16_t *duty) {
+        HSV_COLOR color;
+        RGB_DUTY rgb;
+        color.set(value[0], (uint8_t) value[1], (uint8_t) value[2]);     // integer units, no float in the fader timer
+        HSVtoDuty(color, rgb);
+        duty[0] = rgb.r;
+        duty[1] = rgb.g;
+        duty[2] = rgb.b;
+    }
+};
+
+// Red, green, blue and white channels: hue, saturation, brightness. The white channel
+// takes the part common to the three colours
+struct RGBW_MODEL : RGB_MODEL {
+    static constexpr int CHANNELS = 4;
+    static constexpr int DEVICE = DEVICE_RGBW_LED;
+
+    static void mix(const uint16_t *value, uint16_t *duty) {
+        HSV_COLOR color;
+        RGB_DUTY rgb;
+        color.set(value[0], (uint8_t) value[1], (uint8_t) value[2]);
+        HSVtoDuty(color, rgb);
+        duty[3] = ExtractWhite(rgb);
+        duty[0] = rgb.r;
+        duty[1] = rgb.g;
+        duty[2] = rgb.b;
     }
 };
 
 // =====================================================================================
-// DEV_RgbLED: Class for manage dimmable RGB light type devices (PWM based)
+// DEV_PwmLED: Class for manage PWM light type devices of any colour model
+//
+// The lamp and its polarity are set at boot with lighting.addPwmLamp(), it must have
+// MODEL::CHANNELS channels
 // =====================================================================================
-struct DEV_RgbLED : Service::LightBulb {  // RGB LED (Common Cathode)
+template <typename MODEL>
+struct DEV_PwmLED : Service::LightBulb, LAMP_ACCESSORY {
+
+    static_assert(MODEL::CHANNELS <= MAX_LAMP_CHANNELS && MODEL::VALUES <= MAX_STORED_VALUES, "Colour model too large for the lamps");
 
-    LedPin *redPin, *greenPin, *bluePin;        // Create references to each color LED anode Pin instantiated below
     SpanCharacteristic *power;                  // reference to the On Characteristic
-    SpanCharacteristic *H;                      // reference to the Hue Characteristic
-    SpanCharacteristic *S;                      // reference to the Saturation Characteristic
-    SpanCharacteristic *V;                      // reference to the Brightness Characteristic
-    int actions = 0;                            // pushbutton counter
-    BUTTON_ACTION *action[MAX_PUSHBUTTONS];     // rules for pushbuttons
-    char *accessoryName;                        // accessory name just for login purpose
+    SpanCharacteristic *values[MODEL::VALUES];  // characteristics of the colour model
+    LAMP *lamp;                                 // output owned by the lighting engine
+    LAMP_TARGET target;                         // latest HomeKit write, sent from loop()
 
     // -----------------------------------------------------------------------------------
     // constructor() method
     //
-    // red_pin          reference for the output red anode pin assigned for the class instance
-    // green_pin        reference for the output green anode pin assigned for the class instance
-    // blue_pin         reference for the output blue anode pin assigned for the class instance
+    // lamp             PWM lamp created at boot by lighting.addPwmLamp(), its outputs are
+    //                  already showing the saved state
     // -----------------------------------------------------------------------------------
-    DEV_RgbLED(int red_pin, int green_pin, int blue_pin, char *name) : Service::LightBulb() {  // constructor() method
-
-        power = new Characteristic::On();
-        H = new Characteristic::Hue(0);           // instantiate the Hue Characteristic with an initial value of 0 out of 360
-        S = new Characteristic::Saturation(0);    // instantiate the Saturation Characteristic with an initial value of 0%
-        V = new Characteristic::Brightness(100);  // instantiate the Brightness Characteristic with an initial value of 100%
-        V->setRange(5, 100, 1);                   // sets the range of the Brightness to be from a min of 5%, to a max of 100%, in steps of 1%
+    DEV_PwmLED(LAMP *lamp, char *name) : Service::LightBulb() {
+        const LAMP_STATE *state = stateStore.get(lamp->index, lamp->nChannels);
+        power = new Characteristic::On(lamp->power);
+        MODEL::create(values, state != NULL ? state->value : NULL);
         this->accessoryName = name;
-
-        this->redPin = new LedPin(red_pin, 100);      // configures a PWM LED for output to the RED pin
-        this->greenPin = new LedPin(green_pin, 100);  // configures a PWM LED for output to the GREEN pin
-        this->bluePin = new LedPin(blue_pin, 100);    // configures a PWM LED for output to the BLUE pin
-
+        this->lamp = lamp;
+        lamp->accessory = this;
+        lamp->mix = MODEL::HSV ? MODEL::mix : NULL;
         update();
-    }  // end constructor
+    }
 
     // -----------------------------------------------------------------------------------
     // update() method
     //
-    // updates hardware pin statuses.
+    // takes the requested values as the new target and acknowledges the write right away,
+    // loop() sends the latest target once it is due
     // -----------------------------------------------------------------------------------
-    boolean update() {  // update() method
-
-        boolean p;
-        float v, h, s, r, g, b;
-
-        h = H->getVal<float>();  // get and store all current values.  Note the use of the <float> template to properly read the values
-        s = S->getVal<float>();
-        v = V->getVal<float>();  // though H and S are defined as FLOAT in HAP, V (which is brightness) is defined as INT, but will be re-cast appropriately
-        p = power->getVal();
-
-        LOG2("Updating RGB LED: Pins=(%d,%d,%d): ", redPin->getPin(), greenPin->getPin(), bluePin->getPin());
-
-        if (power->updated()) {
-            p = power->getNewVal();
-            LOG2("Power=%s->%s, ", power->getVal() ? "true" : "false", p ? "true" : "false");
-        } else {
-            LOG2("Power=%s, ", p ? "true" : "false");
+    boolean update() {
+        uint16_t value[MODEL::VALUES];
+        for (int i = 0; i < MODEL::VALUES; i++) {
+            value[i] = values[i]->updated() ? values[i]->getNewVal() : values[i]->getVal();
         }
+        target.write(power->getNewVal(), value, MODEL::VALUES, (uint32_t) esp_timer_get_time());
+        return true;
+    }
 
-        if (H->updated()) {
-            h = H->getNewVal<float>();
-            LOG2("H=%.0f->%.0f, ", H->getVal<float>(), h);
-        } else {
-            LOG2("H=%.0f, ", h);
+    // -----------------------------------------------------------------------------------
+    // loop() method
+    //
+    // sends the target once it is due, at most once per fader frame. The lighting engine
+    // fades to it when the lamp is on
+    // -----------------------------------------------------------------------------------
+    void loop() {
+        uint32_t now = (uint32_t) esp_timer_get_time();
+        if (target.due(now)) {
+            send(now);
         }
+    }
 
-        if (S->updated()) {
-            s = S->getNewVal<float>();
-            LOG2("S=%.0f->%.0f, ", S->getVal<float>(), s);
-        } else {
-            LOG2("S=%.0f, ", s);
+    // -----------------------------------------------------------------------------------
+    // flush() method
+    //
+    // sends the target right away if it is pending, due or not
+    // -----------------------------------------------------------------------------------
+    void flush() override {
+        if (target.pending) {
+            send((uint32_t) esp_timer_get_time());
         }
+    }
 
-        if (V->updated()) {
-            v = V->getNewVal<float>();
-            LOG2("V=%.0f->%.0f  ", V->getVal<float>(), v);
-        } else {
-            LOG2("V=%.0f  ", v);
-        }
+    // -----------------------------------------------------------------------------------
+    // send() method
+    //
+    // mixes the target into channel duties and hands them to the lighting engine. Timed
+    // as the update of the device class, update() itself only copies the values
+    // -----------------------------------------------------------------------------------
+    void send(uint32_t now) {
+        SCOPED_TIMER timer(metrics.updateTime[MODEL::DEVICE]);
+        uint16_t duty[MAX_LAMP_CHANNELS] = {};
+        MODEL::mix(target.value, duty);
+        TRACE(TRACE_UPDATE, lamp->index, target.power, target.value[0]);
+        lighting.set(lamp, target.power, duty, target.value, target.writeTime);
+        target.sent(now);
+    }
 
-        // Here we call a static function of LedPin that converts HSV to RGB.
-        // Parameters must all be floats in range of H[0,360], S[0,1], and V[0,1]
-        // R, G, B, returned [0,1] range as well
-        LedPin::HSVtoRGB(h, s / 100.0, v / 100.0, &r, &g, &b);  // since HomeKit provides S and V in percent, scale down by 100
+    // -----------------------------------------------------------------------------------
+    // syncPower() method
+    //
+    // follows a change done by a pushbutton. Only the power characteristic changes, the
+    // other values are kept so ON restores them
+    // -----------------------------------------------------------------------------------
+    void syncPower(boolean power) override {
+        this->power->setVal(power);
+        target.power = power;               // a pending write does not undo the pushbutton
+    }
 
-        int R, G, B;
-        R = p * r * 100;  // since LedPin uses percent, scale back up by 100, and multiple by status fo power (either 0 or 1)
-        G = p * g * 100;
-        B = p * b * 100;
+    // -----------------------------------------------------------------------------------
+    // setFadeTime() method
+    //
+    // sets the transition time in ms for any further change, 0 switches immediately
+    // -----------------------------------------------------------------------------------
+    void setFadeTime(uint32_t fadeTime) {
+        lamp->fadeTime = fadeTime;
+    }
+};
 
-        LOG2("RGB=(%d,%d,%d)\n", R, G, B);
+typedef DEV_PwmLED<MONO_MODEL> DEV_DimmableLED;         // Dimmable LED
+typedef DEV_PwmLED<CCT_MODEL> DEV_TunableWhiteLED;      // Warm and cool white LED strip
+typedef DEV_PwmLED<RGB_MODEL> DEV_RgbLED;               // RGB LED
+typedef DEV_PwmLED<RGBW_MODEL> DEV_RgbwLED;             // RGBW LED
 
-        redPin->set(100 - R);  // update each ledPin with new values
-        greenPin->set(100 - G);
-        bluePin->set(100 - B);
+// =====================================================================================
+// DEV_EffectSwitch: Class for manage a switch playing an effect on a HSV light
+//
+// Created right after the light it plays on, in the same accessory. Turning the switch
+// on plays the effect and turns the light on, turning it off shows the light again. The
+// switch goes off by itself when the effect finishes or any change of the light stops it.
+// A write is only taken by update() and played from loop(), once every service of the
+// HomeKit request has been updated, so a write to the light in the same request, like a
+// scene, lands before the effect whatever its order in the request
+// =====================================================================================
+struct DEV_EffectSwitch : Service::Switch {
 
-        return true;  // return true
-    }  // update
+    SpanCharacteristic *on;                     // reference to the On Characteristic
+    LAMP_ACCESSORY *light;                      // light playing the effect
+    LAMP *lamp;                                 // output of the light
+    int effect;                                 // index in effectList
+    int request;                                // effect or EFFECT_STOP written by HomeKit and not played yet, EFFECT_NONE if none
+    uint32_t changes;                           // effectPlayer.changes when the effect was last seen playing
 
     // -----------------------------------------------------------------------------------
-    // setActionsOnSpanButton() method
-    //
-    // Attachs action configuration to a specific pin
+    // constructor() method
     //
-    // controlPin       reference for the input button pin assigned for the class instance
-    // actionOnLong     action to be done on long press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnSingle   action to be done on normal press on the asociated button (ON, OFF, TOGGLE or NOTHING)
-    // actionOnDouble   action to be done on quick double click press on the asociated button (ON, OFF, TOGGLE or NOTHING)
+    // light            light playing the effect, its colour model must be HSV
+    // effect           index in effectList
     // -----------------------------------------------------------------------------------
-    boolean setActionsOnSpanButton(int controlPin, int actionOnLong, int actionOnSingle, int actionOnDouble) {
+    template <typename MODEL>
+    DEV_EffectSwitch(DEV_PwmLED<MODEL> *light, int effect) : Service::Switch() {
+        static_assert(MODEL::HSV, "Effects need a HSV colour model");
+        on = new Characteristic::On(0);
+        new Characteristic::Name(effectList[effect].name);
+        this->light = light;
+        this->lamp = light->lamp;
+        this->effect = effect;
+        request = EFFECT_NONE;
+        changes = effectPlayer.changes;
+    }
 
-        if (actions == MAX_PUSHBUTTONS) {
-            return false;                   // Only MAX_PUSHBUTTONS actions supported per accesory
-        }
-        WEBLOG("Configuring ON/OFF for RGB Led accessory %s[Pin#(%d,%d,%d)] with control pushbutton on pin %d and index #%d", accessoryName, redPin->getPin(), greenPin->getPin(), bluePin->getPin(), controlPin, actions);
-        WEBLOG("      %s on normal click", Action2Name(actionOnSingle));
-        WEBLOG("      %s on double click", Action2Name(actionOnDouble));
-        WEBLOG("      %s on long press", Action2Name(actionOnLong));
-        new SpanButton(controlPin, LONGPULSE, MINIMUMPULSE, SHORTPULSE);
-        this->action[actions] = new BUTTON_ACTION(controlPin, actionOnLong, actionOnSingle, actionOnDouble);
-        actions++;
+    // -----------------------------------------------------------------------------------
+    // update() method
+    //
+    // takes the request to start or stop the effect, played by the next loop()
+    // -----------------------------------------------------------------------------------
+    boolean update() {
+        request = on->getNewVal() ? effect : EFFECT_STOP;
         return true;
     }
 
     // -----------------------------------------------------------------------------------
-    // button() method
+    // loop() method
     //
-    // handles clic on button. Library pass button pin id and press type so its responsability
-    // of the handler to decide what to do with the button an press type
+    // starts or stops the effect requested by HomeKit, the light is sent any write still
+    // held back first or it would stop the effect it comes with. Otherwise turns the
+    // switch off once the effect is no longer playing
     // -----------------------------------------------------------------------------------
-    void button(int pin, int pressType) override {
-
-        LOG2("Accessory %s on pins (%d, %d, %d) button handler got button press on pin %d with type %s\n", accessoryName, redPin->getPin(), greenPin->getPin(), bluePin->getPin(), pin, pressType == SpanButton::LONG ? "LONG" : (pressType == SpanButton::SINGLE ? "SINGLE" : (pressType == SpanButton::DOUBLE ? "DOUBLE" : "???")));
-        for (int i = 0; i < this->actions; i++) {
-            LOG2("   Pushbutton index #%d ", i);
-            if (pin == action[i]->controlPin) {
-                LOG2("configured for pin #%d ", pin);
-                int a = ((pressType == SpanButton::SINGLE) ? action[i]->actionOnSingle : ((pressType == SpanButton::DOUBLE) ? action[i]->actionOnDouble : ((pressType == SpanButton::LONG) ? action[i]->actionOnLong : NOTHING)));
-                LOG2("with action: #%s\n", Action2Name(a));
-                if(a == NOTHING) {
-                    LOG2("      Nothing to do\n");
-                } else {
-                    if(a == OFF) {
-                        power->setVal(0);
-                        H = new Characteristic::Hue(0);
-                        S = new Characteristic::Saturation(0);
-                        V = new Characteristic::Brightness(0);
-                        LOG2("      Accessory going OFF\n");
-                        update();
-                        LOG2("      Updating...\n");
-                    } else {
-                        if(a == TOGGLE) {
-                            LOG2("Not supported\n");
-                        } else {
-                            LOG2("Not supported\n");
-                        }
-                    }
-                }
-                LOG2("   Exit handler\n");
-                return;
-            } else {
-                LOG2("not configured for pin #%d \n", pin);
+    void loop() {
+        if (request != EFFECT_NONE) {
+            light->flush();
+            if (request != EFFECT_STOP) {
+                lighting.play(lamp, effect);
+                light->syncPower(true);
+            } else if (effectPlayer.playing(lamp->index) == effect) {
+                lighting.play(lamp, EFFECT_STOP);
             }
+            request = EFFECT_NONE;
+            changes = effectPlayer.changes;     // the lighting side may not have started it yet
+            return;
+        }
+        uint32_t now = effectPlayer.changes;
+        if (now == changes) {
+            return;
+        }
+        changes = now;
+        if (on->getVal() && effectPlayer.playing(lamp->index) != effect) {
+            on->setVal(false);
         }
-        LOG2("   Exit handler\n");
     }
 };
+
+#endif
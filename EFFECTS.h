@@ -0,0 +1,274 @@
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+#include <atomic>
+#include <time.h>
+#include <sys/time.h>
+#include "FADER.h"
+
+#define MAX_EFFECT_CHANNELS 4       // PWM channels an effect can drive, at least MAX_LAMP_CHANNELS
+#define EFFECT_NONE -1              // plain lamp change, no effect involved
+#define EFFECT_STOP -2              // stop the effect and show the lamp state again
+#define DAY_MS 86400000             // length of a daily effect
+#define EFFECT_ANCHOR_MS 60000      // daily effects take the wall clock again this often
+
+// Mixing of a colour model, turns characteristic values into channel duties
+typedef void (*MIX_FUNCTION)(const uint16_t *value, uint16_t *duty);
+
+// How an effect goes on after its last keyframe
+enum EFFECT_MODE : uint8_t {
+    EFFECT_ONCE,                    // holds the last keyframe, the effect is then finished
+    EFFECT_DAILY,                   // keyframe times are the time of the day, repeats every day
+    EFFECT_HOLD                     // holds the last keyframe until stopped
+};
+
+// =====================================================================================
+// KEYFRAME: Colour of an effect at a given time, in the units of the effect
+// =====================================================================================
+struct KEYFRAME {
+    uint16_t time;                              // time since the effect start, or time of the day
+    uint16_t hue;                               // [0,360]
+    uint8_t saturation;                         // [0,100] in percent
+    uint8_t brightness;                         // [0,100] in percent
+};
+
+// =====================================================================================
+// EFFECT: Keyframe curve stored in flash
+// =====================================================================================
+struct EFFECT {
+    const char *name;                           // name shown in HomeKit
+    const KEYFRAME *frames;                     // keyframes in time order, the first one at time 0
+    uint8_t nFrames;                            // keyframe counter
+    EFFECT_MODE mode;                           // what happens after the last keyframe
+    uint32_t unit;                              // ms per keyframe time unit
+};
+
+// 30 minutes from a deep red glow to bright warm white, in seconds
+constexpr KEYFRAME sunriseFrames[] = {
+    {    0,  0, 100,   1 },
+    {  300,  5, 100,   5 },
+    {  900, 20,  90,  25 },
+    { 1500, 30,  70,  60 },
+    { 1800, 35,  40, 100 },
+};
+
+// Colour through the day, warm and dim at night, neutral at noon, in minutes of the day
+constexpr KEYFRAME circadianFrames[] = {
+    {    0, 25, 100,   5 },
+    {  360, 25, 100,   5 },
+    {  420, 30,  60,  60 },
+    {  600, 40,  15, 100 },
+    { 1080, 35,  40,  80 },
+    { 1260, 25,  90,  30 },
+    { 1440, 25, 100,   5 },
+};
+
+// Dim amber glow
+constexpr KEYFRAME nightLightFrames[] = {
+    {    0, 30, 100,   3 },
+};
+
+#define EFFECT_FRAMES(frames) frames, sizeof(frames) / sizeof(KEYFRAME)
+
+constexpr EFFECT effectList[] = {
+    { "Sunrise",     EFFECT_FRAMES(sunriseFrames),    EFFECT_ONCE,  1000  },
+    { "Circadian",   EFFECT_FRAMES(circadianFrames),  EFFECT_DAILY, 60000 },
+    { "Night light", EFFECT_FRAMES(nightLightFrames), EFFECT_HOLD,  1000  },
+};
+
+#define EFFECT_COUNT ((int) (sizeof(effectList) / sizeof(EFFECT)))
+
+// =====================================================================================
+// EFFECT_PLAYER: Plays an effect on the PWM channels of one lamp from the fader timer
+//
+// Keyframes are mixed into duties only when a segment starts, every frame is then a
+// linear interpolation of the channel duties, integer only and without heap. All the
+// state is changed with the fader mux taken, so a lamp change stopping the effect never
+// races with a frame. Effect time is kept in 64 bit ms of esp_timer, daily effects read
+// the wall clock again every EFFECT_ANCHOR_MS, so they follow NTP, DST and clock drift.
+// =====================================================================================
+struct EFFECT_PLAYER {
+
+    int effect = EFFECT_NONE;                   // effect being played
+    int lamp = -1;                              // lamp playing the effect
+    int nChannels = 0;                          // PWM channels of the lamp
+    int channel[MAX_EFFECT_CHANNELS];           // fader channels
+    MIX_FUNCTION mix = NULL;                    // colour model of the lamp
+    uint64_t startTime = 0;                     // esp_timer ms the effect time 0 was, daily effects: last midnight
+    uint64_t anchorTime = 0;                    // esp_timer ms the wall clock was last read
+    int segment = -1;                           // keyframe starting the current segment, -1 to be found
+    uint32_t segmentStart = 0;                  // segment start in ms of effect time
+    uint32_t segmentLength = 0;                 // segment length in ms, 0 holds the first keyframe
+    uint16_t from[MAX_EFFECT_CHANNELS];         // duties at the segment start
+    uint16_t to[MAX_EFFECT_CHANNELS];           // duties at the segment end
+    boolean finished = false;                   // true once an EFFECT_ONCE effect reached its end
+    boolean timerHeld = false;                  // true while the effect keeps the fader timer running
+    std::atomic<uint32_t> changes{0};           // effect started, stopped or finished, for the HomeSpan side
+
+    // -----------------------------------------------------------------------------------
+    // start() method
+    //
+    // lighting side: plays an effect on a lamp, any other effect is stopped
+    // -----------------------------------------------------------------------------------
+    void start(int effect, int lamp, int nChannels, const int *channels, MIX_FUNCTION mix) {
+        if (effect < 0 || effect >= EFFECT_COUNT || mix == NULL || nChannels > MAX_EFFECT_CHANNELS) {
+            return;
+        }
+        uint64_t now = esp_timer_get_time() / 1000;
+        uint32_t day = effectList[effect].mode == EFFECT_DAILY ? TimeOfDay() : 0;
+        portENTER_CRITICAL(&fader.mux);
+        if (!timerHeld) {
+            fader.holders++;
+            timerHeld = true;
+        }
+        this->effect = effect;
+        this->lamp = lamp;
+        this->nChannels = nChannels;
+        for (int i = 0; i < nChannels; i++) {
+            channel[i] = channels[i];
+        }
+        this->mix = mix;
+        startTime = now - day;
+        anchorTime = now;
+        segment = -1;
+        finished = false;
+        fader.frameHook = onFrame;
+        portEXIT_CRITICAL(&fader.mux);
+        changes++;
+        fader.start();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // stop() method
+    //
+    // lighting side: stops the effect of a lamp, the channels keep the last frame until
+    // the lamp fades them somewhere else
+    // -----------------------------------------------------------------------------------
+    void stop(int lamp) {
+        if (this->lamp != lamp) {
+            return;
+        }
+        portENTER_CRITICAL(&fader.mux);
+        if (timerHeld) {
+            fader.holders--;
+            timerHeld = false;
+        }
+        effect = EFFECT_NONE;
+        this->lamp = -1;
+        portEXIT_CRITICAL(&fader.mux);
+        changes++;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // playing() method
+    //
+    // returns the effect a lamp is playing, EFFECT_NONE if none or finished
+    // -----------------------------------------------------------------------------------
+    int playing(int lamp) {
+        return this->lamp == lamp && !finished ? effect : EFFECT_NONE;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // frame() method
+    //
+    // fader timer: computes the duties of the current time and holds them on the channels,
+    // the fader latches them with the rest of the frame.
+    // Once the last keyframe of a non daily effect is reached the timer is released, the
+    // channels simply keep it
+    // -----------------------------------------------------------------------------------
+    void frame() {
+        int n = 0;
+        uint64_t now = esp_timer_get_time() / 1000;
+        boolean anchor = now - anchorTime >= EFFECT_ANCHOR_MS;
+        uint32_t day = anchor ? TimeOfDay() : 0;        // not under the mux, checked again below
+        portENTER_CRITICAL(&fader.mux);
+        if (effect != EFFECT_NONE) {
+            const EFFECT &e = effectList[effect];
+            if (anchor && now - anchorTime >= EFFECT_ANCHOR_MS) {
+                startTime = e.mode == EFFECT_DAILY ? now - day : startTime;
+                anchorTime = now;
+            }
+            uint64_t t = now - startTime;
+            if (e.mode == EFFECT_DAILY) {
+                t %= DAY_MS;
+            }
+            if (segment < 0 || t < segmentStart) {
+                segment = 0;
+                enterSegment(e);
+            }
+            while (segment + 1 < e.nFrames && t >= e.frames[segment + 1].time * e.unit) {
+                segment++;
+                enterSegment(e);
+            }
+            uint32_t f = segmentLength == 0 ? 0 : (uint32_t) (((uint64_t) (t - segmentStart) << 8) / segmentLength);
+            f = f > 256 ? 256 : f;
+            for (int i = 0; i < nChannels; i++) {
+                fader.hold(channel[i], from[i] + (((int32_t) to[i] - from[i]) * (int32_t) f >> 8));
+            }
+            if (segment + 1 == e.nFrames && e.mode != EFFECT_DAILY) {
+                if (e.mode == EFFECT_ONCE && !finished) {
+                    finished = true;
+                    changes++;
+                }
+                if (timerHeld) {
+                    fader.holders--;
+                    timerHeld = false;
+                }
+            }
+            n = nChannels;
+        }
+        portEXIT_CRITICAL(&fader.mux);
+        for (int i = 0; i < n; i++) {
+            fader.write(fader.channels[channel[i]]);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // enterSegment() method
+    //
+    // mixes the keyframes around the current segment, called from frame()
+    // -----------------------------------------------------------------------------------
+    void enterSegment(const EFFECT &e) {
+        const KEYFRAME &a = e.frames[segment];
+        const KEYFRAME &b = e.frames[segment + 1 < e.nFrames ? segment + 1 : segment];
+        uint16_t value[3] = {a.hue, a.saturation, a.brightness};
+        mix(value, from);
+        value[0] = b.hue;
+        value[1] = b.saturation;
+        value[2] = b.brightness;
+        mix(value, to);
+        segmentStart = a.time * e.unit;
+        segmentLength = b.time * e.unit - segmentStart;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // onFrame() method
+    //
+    // fader frame hook
+    // -----------------------------------------------------------------------------------
+    static void onFrame(uint32_t now);
+
+    // -----------------------------------------------------------------------------------
+    // TimeOfDay() method
+    //
+    // returns the ms since local midnight, noon if the clock was not set by NTP yet
+    // -----------------------------------------------------------------------------------
+    static uint32_t TimeOfDay() {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        struct tm local;
+        localtime_r(&now.tv_sec, &local);
+        if (local.tm_year < 120) {
+            return DAY_MS / 2;
+        }
+        return ((local.tm_hour * 60 + local.tm_min) * 60 + local.tm_sec) * 1000UL + now.tv_usec / 1000;
+    }
+};
+
+EFFECT_PLAYER effectPlayer;                 // effects of the PWM lamps
+
+void EFFECT_PLAYER::onFrame(uint32_t now) {
+    effectPlayer.frame();
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef FADER_H
+#define FADER_H
+
+#include "esp_timer.h"
+#include "esp_pm.h"
+#include "COLOR.h"
+#include "PWM_STAGE.h"
+
+#define FADE_FRAME_US 5000          // fade frame period, 200 frames per second
+#define FADE_TIME 400               // default transition time in ms
+#define MAX_FADE_CHANNELS MAX_PWM_OUTPUTS  // PWM channels that can be faded, one per output
+
+// =====================================================================================
+// FADER: Smooth transitions for PWM channels driven from a periodic esp_timer
+//
+// Accessories only set a target duty, the timer interpolates every channel from the
+// duty it had when the target was set to the new one. A new target received in the
+// middle of a fade restarts it from the duty being shown, so the light never jumps.
+// The timer runs on its own task, fades go on while homeSpan.poll() is blocked and
+// the timer is stopped when every channel has reached its target. Every frame is
+// staged first and latched on the outputs at once, see PWM_STAGE. Light sleep is kept
+// away while the timer runs, so frames are not delayed by wake ups.
+// =====================================================================================
+struct FADER {
+
+    struct FADE_CHANNEL {
+        int output;                             // pwmStage output
+        uint16_t from;                          // duty when the fade started
+        uint16_t to;                            // target duty
+        uint16_t current;                       // duty being shown
+        uint32_t startTime;                     // fade start time in us
+        uint32_t duration;                      // fade duration in us, 0 if the channel is settled
+    };
+
+    FADE_CHANNEL channels[MAX_FADE_CHANNELS];   // faded channels
+    int nChannels = 0;                          // channel counter
+    esp_timer_handle_t timer = NULL;            // frame timer, created on first use
+    esp_pm_lock_handle_t sleepLock = NULL;      // no light sleep while the timer runs, NULL if power management is not built in
+    volatile boolean running = false;           // true while the frame timer is started
+    uint32_t frames = 0;                        // frames computed since boot
+    int holders = 0;                            // users keeping the timer running besides fades, changed under mux
+    void (*frameHook)(uint32_t now) = NULL;     // called first on every frame, NULL if none
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    // -----------------------------------------------------------------------------------
+    // addChannel() method
+    //
+    // creates a PWM output showing a duty and returns its channel index or -1 if there is
+    // no room
+    // pin              output pin
+    // inverted         true if the output is active low
+    // duty             initial duty [0,DUTY_MAX]
+    // phase            pulse start [0,DUTY_MAX], fraction of the PWM period
+    // -----------------------------------------------------------------------------------
+    int addChannel(int pin, boolean inverted, uint16_t duty, uint16_t phase) {
+        if (nChannels == MAX_FADE_CHANNELS) {
+            return -1;                      // Only MAX_FADE_CHANNELS channels supported
+        }
+        int output = pwmStage.addOutput(pin, inverted, duty, phase);
+        if (output < 0) {
+            return -1;
+        }
+        FADE_CHANNEL &channel = channels[nChannels];
+        channel.output = output;
+        channel.from = channel.to = channel.current = duty;
+        channel.startTime = 0;
+        channel.duration = 0;
+        return nChannels++;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // fadeTo() method
+    //
+    // sets a new target for a channel
+    // index            channel index returned by addChannel()
+    // duty             target duty [0,DUTY_MAX]
+    // fadeTime         transition time in ms, 0 switches at the next frame
+    // -----------------------------------------------------------------------------------
+    void fadeTo(int index, uint16_t duty, uint32_t fadeTime) {
+        if (index < 0 || index >= nChannels) {
+            return;
+        }
+        FADE_CHANNEL &channel = channels[index];
+        portENTER_CRITICAL(&mux);
+        channel.from = channel.current;
+        channel.to = duty;
+        channel.startTime = (uint32_t) esp_timer_get_time();
+        channel.duration = fadeTime == 0 ? 1 : fadeTime * 1000;
+        portEXIT_CRITICAL(&mux);
+        start();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // tick() method
+    //
+    // computes one frame and stages the channels that changed. Returns true while any
+    // channel is still fading
+    // now              current time in us
+    // -----------------------------------------------------------------------------------
+    boolean tick(uint32_t now) {
+        boolean fading = false;
+        frames++;
+        for (int i = 0; i < nChannels; i++) {
+            FADE_CHANNEL &channel = channels[i];
+            portENTER_CRITICAL(&mux);
+            if (channel.duration == 0) {
+                portEXIT_CRITICAL(&mux);
+                continue;
+            }
+            uint32_t elapsed = now - channel.startTime;
+            if (elapsed >= channel.duration) {
+                channel.current = channel.to;
+                channel.duration = 0;
+            } else {
+                int32_t delta = (int32_t) channel.to - channel.from;
+                channel.current = channel.from + (int32_t) (((int64_t) delta * elapsed) / channel.duration);
+                fading = true;
+            }
+            portEXIT_CRITICAL(&mux);
+            write(channel);
+        }
+        return fading;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // hold() method
+    //
+    // sets the duty of a channel right away cancelling any fade, must be called with the
+    // mux taken. The output is staged by a later call to write()
+    // -----------------------------------------------------------------------------------
+    void hold(int index, uint16_t duty) {
+        FADE_CHANNEL &channel = channels[index];
+        channel.from = channel.to = channel.current = duty;
+        channel.duration = 0;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // isFading() method
+    //
+    // returns true while the frame timer is running
+    // -----------------------------------------------------------------------------------
+    boolean isFading() {
+        return running;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // start() method
+    //
+    // starts the frame timer if it is not already running
+    // -----------------------------------------------------------------------------------
+    void start() {
+        if (timer == NULL) {
+            esp_timer_create_args_t args = {};
+            args.callback = onTimer;
+            args.arg = this;
+            args.name = "fader";
+            esp_timer_create(&args, &timer);
+            esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "fader", &sleepLock);
+        }
+        portENTER_CRITICAL(&mux);
+        boolean idle = !running;
+        running = true;
+        portEXIT_CRITICAL(&mux);
+        if (idle) {
+            if (sleepLock != NULL) {
+                esp_pm_lock_acquire(sleepLock);
+            }
+            esp_timer_start_periodic(timer, FADE_FRAME_US);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // write() method
+    //
+    // stages the duty of a channel, shown on the next pwmStage.latch()
+    // -----------------------------------------------------------------------------------
+    void write(FADE_CHANNEL &channel) {
+        pwmStage.stage(channel.output, channel.current);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // onTimer() method
+    //
+    // esp_timer callback, latches the frame on the outputs and stops the timer once every
+    // channel is settled and nobody holds it, light sleep is then allowed again
+    // -----------------------------------------------------------------------------------
+    static void onTimer(void *arg) {
+        FADER *fader = (FADER *) arg;
+        uint32_t now = (uint32_t) esp_timer_get_time();
+        if (fader->frameHook != NULL) {
+            fader->frameHook(now);
+        }
+        boolean fading = fader->tick(now);
+        pwmStage.latch();
+        if (!fading) {
+            portENTER_CRITICAL(&fader->mux);
+            boolean settled = fader->holders == 0;
+            for (int i = 0; i < fader->nChannels; i++) {
+                settled = settled && fader->channels[i].duration == 0;
+            }
+            if (settled) {
+                fader->running = false;
+                esp_timer_stop(fader->timer);
+            }
+            portEXIT_CRITICAL(&fader->mux);
+            if (settled && fader->sleepLock != NULL) {
+                esp_pm_lock_release(fader->sleepLock);
+            }
+        }
+    }
+};
+
+FADER fader;                                // shared by all PWM accessories
+
+#endif
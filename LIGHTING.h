@@ -0,0 +1,566 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include "SPSC_QUEUE.h"
+#include "SCENE.h"
+#include "FADER.h"
+#include "BUTTON_MANAGER.h"
+#include "TRACE.h"
+#include "STATE_STORE.h"
+#include "METRICS.h"
+#include "EFFECTS.h"
+#include "POWER_MANAGER.h"
+
+#define MAX_LAMPS 8                 // lamps driven by the lighting engine
+#define MAX_LAMP_CHANNELS 4         // PWM channels per lamp, RGBW
+#define LIGHTING_QUEUE_SIZE 32      // commands or events that can be pending, power of two
+#define LIGHTING_TASK_STACK 4096    // stack size of the lighting task
+#define LIGHTING_TASK_PRIORITY 5    // above loop(), below the WiFi stack
+#define LIGHTING_INLINE -1          // no dedicated task, the engine runs from loop()
+
+static_assert(MAX_LAMPS <= MAX_STORED_LAMPS && MAX_LAMP_CHANNELS <= MAX_STORED_VALUES, "STATE_STORE too small for the lamps");
+static_assert(MAX_LAMPS <= METRIC_LAMPS, "METRICS too small for the lamps");
+static_assert(MAX_LAMP_CHANNELS <= MAX_EFFECT_CHANNELS, "EFFECT_PLAYER too small for the lamps");
+
+// =====================================================================================
+// LAMP_ACCESSORY: Interface for HomeSpan services whose output is owned by the lighting
+//                 engine
+// =====================================================================================
+struct LAMP_ACCESSORY {
+
+    char *accessoryName;                        // accessory name just for login purpose
+
+    // -----------------------------------------------------------------------------------
+    // syncPower() method
+    //
+    // called from loop() when a pushbutton changed the lamp, the output is already set
+    // so only the characteristics must follow
+    // -----------------------------------------------------------------------------------
+    virtual void syncPower(boolean power) = 0;
+
+    // -----------------------------------------------------------------------------------
+    // flush() method
+    //
+    // sends any HomeKit write still held back, so a command sent next lands after it
+    // -----------------------------------------------------------------------------------
+    virtual void flush() {}
+};
+
+// =====================================================================================
+// LIGHT_COMMAND: Output change requested from the HomeSpan side
+// =====================================================================================
+struct LIGHT_COMMAND {
+    uint8_t lamp;                               // lamp index
+    uint8_t power;                              // 1 if the lamp must be on
+    uint16_t duty[MAX_LAMP_CHANNELS];           // PWM duties when on
+    uint32_t time;                              // esp_timer time of the HomeKit write in us
+    int8_t effect;                              // effect to play, EFFECT_STOP or EFFECT_NONE for a plain change
+};
+
+// =====================================================================================
+// LIGHT_EVENT: Power change done by a pushbutton, reported to the HomeSpan side
+// =====================================================================================
+struct LIGHT_EVENT {
+    uint8_t lamp;                               // lamp index
+    uint8_t power;                              // 1 if the lamp is on
+};
+
+// =====================================================================================
+// LAMP_TARGET: Latest characteristic values written by HomeKit to a lamp
+//
+// HomeSpan side. A slider drag sends writes faster than the output can follow, so every
+// write only overwrites the target and the lamp is sent the latest values once they are
+// due, at most once per fader frame. The lag of a write is then bounded by one frame plus
+// one loop() iteration, whatever the write rate
+// =====================================================================================
+struct LAMP_TARGET {
+
+    boolean power = false;                      // requested power
+    uint16_t value[MAX_STORED_VALUES] = {};     // requested characteristic values
+    boolean pending = false;                    // true if there are writes not sent yet
+    uint32_t writeTime = 0;                     // esp_timer time in us of the oldest write not sent yet
+    uint32_t sendTime = 0;                      // esp_timer time in us of the last send
+    uint32_t writes = 0;                        // writes since boot
+    uint32_t sends = 0;                         // sends since boot
+
+    // -----------------------------------------------------------------------------------
+    // write() method
+    //
+    // takes the values of a HomeKit write, replacing any not sent yet
+    // nValues          characteristic values of the colour model
+    // now              esp_timer time in us
+    // -----------------------------------------------------------------------------------
+    void write(boolean power, const uint16_t *value, int nValues, uint32_t now) {
+        this->power = power;
+        for (int i = 0; i < nValues; i++) {
+            this->value[i] = value[i];
+        }
+        if (!pending) {
+            pending = true;
+            writeTime = now;
+        }
+        writes++;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // due() method
+    //
+    // returns true if the target must be sent now
+    // -----------------------------------------------------------------------------------
+    boolean due(uint32_t now) {
+        return pending && now - sendTime >= FADE_FRAME_US;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // sent() method
+    //
+    // marks the target as sent
+    // -----------------------------------------------------------------------------------
+    void sent(uint32_t now) {
+        pending = false;
+        sendTime = now;
+        sends++;
+    }
+};
+
+// =====================================================================================
+// LAMP: Output state of one accessory as seen by the lighting engine
+//
+// Either a relay or a set of faded PWM channels. Lamps are created first thing at boot
+// with their saved state, HomeSpan services attach to them later. Pushbuttons act on the
+// lamp directly and the HomeSpan characteristics are synchronized afterwards
+// =====================================================================================
+struct LAMP {
+
+    LAMP_ACCESSORY *accessory;                  // HomeSpan service the lamp belongs to, NULL until it is created
+    uint8_t index;                              // lamp index, used on commands and events
+    int relayPin;                               // relay output or -1 for PWM lamps
+    int relayOnLevel;                           // relay level that turns the lamp on
+    int nChannels;                              // PWM channels
+    int channel[MAX_LAMP_CHANNELS];             // fader channels
+    uint16_t duty[MAX_LAMP_CHANNELS];           // PWM duties when on
+    uint32_t fadeTime;                          // transition time in ms
+    MIX_FUNCTION mix;                           // colour model of the accessory, NULL if effects can not be played
+    boolean power;                              // state shown on the outputs
+    SPSC_QUEUE<LIGHT_EVENT, LIGHTING_QUEUE_SIZE> *events;  // where pushbutton changes are reported
+    std::atomic<uint32_t> *unsynced;            // where lamps are flagged when their event is lost on a full queue
+
+    // -----------------------------------------------------------------------------------
+    // apply() method
+    //
+    // stages the outputs for the current state, stopping any effect of the lamp. Relays
+    // switch when the scene is committed, PWM channels land together on the next fader frame
+    // -----------------------------------------------------------------------------------
+    void apply(SCENE &scene) {
+        effectPlayer.stop(index);
+        if (relayPin >= 0) {
+            scene.setRelay(relayPin, power ? relayOnLevel : !relayOnLevel);
+        }
+        for (int i = 0; i < nChannels; i++) {
+            fader.fadeTo(channel[i], power ? duty[i] : 0, fadeTime);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // stageAction() method
+    //
+    // applies a pushbutton action and reports the new power state to HomeSpan. If the
+    // queue is full the lamp is flagged instead and HomeSpan takes its state from lamps[]
+    // action           ON, OFF or TOGGLE
+    // scene            scene collecting the outputs of all the lamps affected by the press
+    // -----------------------------------------------------------------------------------
+    void stageAction(int action, SCENE &scene) {
+        if (action == OFF) {
+            power = false;
+        } else if (action == TOGGLE) {
+            power = !power;
+        } else {
+            power = true;
+        }
+        apply(scene);
+        TRACE(TRACE_LAMP, index, action, power);
+        LIGHT_EVENT event = {index, (uint8_t) power};
+        if (!events->push(event)) {
+            unsynced->fetch_or(1 << index, std::memory_order_release);
+            metrics.droppedEvents.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+// =====================================================================================
+// LIGHTING: Owns the lamp outputs and the pushbuttons
+//
+// HomeSpan services send LIGHT_COMMANDs, the engine reports pushbutton changes back as
+// LIGHT_EVENTs, both through lock free queues. With begin(core) the engine runs on its
+// own task pinned to that core, away from homeSpan.poll(), so wall switches are served
+// while HomeSpan is busy with pairing, crypto or WiFi. With LIGHTING_INLINE everything
+// runs from loop() as before.
+// =====================================================================================
+struct LIGHTING {
+
+    LAMP lamps[MAX_LAMPS];                      // configured lamps
+    int nLamps = 0;                             // lamp counter
+    SPSC_QUEUE<LIGHT_COMMAND, LIGHTING_QUEUE_SIZE> commands;   // HomeSpan -> lighting
+    SPSC_QUEUE<LIGHT_EVENT, LIGHTING_QUEUE_SIZE> events;       // lighting -> HomeSpan
+    std::atomic<uint32_t> unsynced{0};          // bit mask of the lamps whose last event was lost
+    SCENE scene;                                // outputs of the commands being processed
+    TaskHandle_t task = NULL;                   // lighting task, NULL when running inline
+    uint32_t restoreTime = 0;                   // us from app start until the last lamp output was restored, bootloader not included
+    std::atomic<void (*)()> job{NULL};          // one shot function to be run on the lighting side
+
+    // -----------------------------------------------------------------------------------
+    // addRelayLamp() method
+    //
+    // registers a relay driven lamp, drives it to its saved state and returns it, NULL if
+    // there is no room. Meant to be called first thing in setup()
+    // pin              relay output pin
+    // onLevel          level that turns the lamp on
+    // -----------------------------------------------------------------------------------
+    LAMP *addRelayLamp(int pin, int onLevel) {
+        LAMP *lamp = add();
+        if (lamp != NULL) {
+            lamp->relayPin = pin;
+            lamp->relayOnLevel = onLevel;
+            restore(lamp);
+            scene.begin();
+            lamp->apply(scene);
+            scene.commit();
+            pinMode(pin, OUTPUT);           // level already latched, the relay does not chatter
+        }
+        return lamp;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // addPwmLamp() method
+    //
+    // registers a PWM lamp, drives it to its saved state and returns it, NULL if there is
+    // no room. Meant to be called first thing in setup()
+    // nChannels        number of PWM channels [1,MAX_LAMP_CHANNELS]
+    // pins             PWM output pins
+    // inverted         true if the outputs are active low
+    // -----------------------------------------------------------------------------------
+    LAMP *addPwmLamp(int nChannels, const int *pins, boolean inverted) {
+        LAMP *lamp = nChannels > MAX_LAMP_CHANNELS ? NULL : add();
+        if (lamp != NULL) {
+            lamp->nChannels = nChannels;
+            restore(lamp);
+            for (int i = 0; i < nChannels; i++) {
+                uint16_t phase = PWM_PHASE_SHIFT ? i * DUTY_MAX / nChannels : 0;
+                lamp->channel[i] = fader.addChannel(pins[i], inverted, lamp->power ? lamp->duty[i] : 0, phase);
+            }
+        }
+        return lamp;
+    }
+
+    template <int CHANNELS>
+    LAMP *addPwmLamp(const int (&pins)[CHANNELS], boolean inverted) {
+        return addPwmLamp(CHANNELS, pins, inverted);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // set() method
+    //
+    // HomeSpan side: requests a new output state for a lamp
+    // lamp             lamp to be changed
+    // power            true if the lamp must be on
+    // duty             PWM duties when on, NULL for relay lamps
+    // value            characteristic values restored at boot, NULL if there are none
+    // writeTime        esp_timer time in us of the HomeKit write, 0 for now
+    // -----------------------------------------------------------------------------------
+    boolean set(LAMP *lamp, boolean power, const uint16_t *duty, const uint16_t *value, uint32_t writeTime = 0) {
+        LIGHT_COMMAND command;
+        command.lamp = lamp->index;
+        command.power = power;
+        for (int i = 0; i < MAX_LAMP_CHANNELS; i++) {
+            command.duty[i] = (duty != NULL && i < lamp->nChannels) ? duty[i] : 0;
+        }
+        command.time = writeTime != 0 ? writeTime : (uint32_t) esp_timer_get_time();
+        command.effect = EFFECT_NONE;
+        stateStore.update(lamp->index, lamp->nChannels, power, duty, value);
+        return send(command);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // play() method
+    //
+    // HomeSpan side: plays an effect on a PWM lamp, turning it on. The lamp duties are kept
+    // and shown again when the effect is stopped or the lamp is changed
+    // lamp             lamp with a colour model, see LAMP::mix
+    // effect           index in effectList or EFFECT_STOP
+    // -----------------------------------------------------------------------------------
+    boolean play(LAMP *lamp, int effect) {
+        LIGHT_COMMAND command = {};
+        command.lamp = lamp->index;
+        command.power = effect != EFFECT_STOP;
+        command.time = (uint32_t) esp_timer_get_time();
+        command.effect = effect;
+        if (effect != EFFECT_STOP) {
+            stateStore.update(lamp->index, lamp->nChannels, true, NULL, NULL);
+        }
+        return send(command);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // send() method
+    //
+    // HomeSpan side: queues a command and wakes the lighting side up
+    // -----------------------------------------------------------------------------------
+    boolean send(const LIGHT_COMMAND &command) {
+        powerManager.touch();
+        boolean queued = commands.push(command);
+        if (!queued) {
+            metrics.droppedCommands.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (task == NULL) {
+            applyCommands();
+        } else {
+            xTaskNotifyGive(task);
+        }
+        return queued;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // starts the lighting engine. Must be called at the end of setup(), once every
+    // accessory has been created
+    // core             core for the lighting task or LIGHTING_INLINE to run from loop()
+    // wiring           pushbutton dispatch table, lamp ids are the accessory creation order
+    // -----------------------------------------------------------------------------------
+    template <int BUTTONS, int RULES>
+    void begin(int core, const BUTTON_WIRING<BUTTONS, RULES> &wiring) {
+        buttonManager.begin(wiring);
+        for (int b = 0; b < BUTTONS; b++) {
+            for (int t = 0; t < BUTTON_PRESS_TYPES; t++) {
+                int group = b * BUTTON_PRESS_TYPES + t;
+                for (int e = wiring.first[group]; e < wiring.first[group + 1]; e++) {
+                    const BUTTON_DISPATCH &entry = wiring.entry[e];
+                    if (entry.lamp >= nLamps || lamps[entry.lamp].accessory == NULL) {
+                        WEBLOG("Pushbutton on pin %d drives lamp #%d which has no accessory", wiring.pin[b], entry.lamp);
+                        continue;
+                    }
+                    metrics.lampNames[entry.lamp] = lamps[entry.lamp].accessory->accessoryName;
+                    WEBLOG("Pushbutton on pin %d: %s %s on %s press", wiring.pin[b], lamps[entry.lamp].accessory->accessoryName, Action2Name(entry.action), PressType2Name(t));
+                }
+            }
+        }
+        WEBLOG("Lamp outputs restored %u us after app start, %s", restoreTime, stateStore.restored ? "from saved state" : "no saved state");
+        if (core == LIGHTING_INLINE) {
+            WEBLOG("Lighting engine running from loop()");
+            return;
+        }
+        if (xTaskCreatePinnedToCore(taskLoop, "lighting", LIGHTING_TASK_STACK, this, LIGHTING_TASK_PRIORITY, &task, core) != pdPASS) {
+            task = NULL;
+            WEBLOG("Unable to start lighting task, running from loop()");
+            return;
+        }
+        buttonManager.notify = task;
+        xTaskNotifyGive(task);              // edges captured before the task was known
+        WEBLOG("Lighting engine running on core %d", core);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // loop() method
+    //
+    // HomeSpan side, must be called from loop(). Runs the engine when there is no
+    // dedicated task, brings the characteristics in line with pushbutton changes and
+    // saves the lamp states. Lamps whose event was lost follow their output state, read
+    // once the queue is empty so it is newer than any event
+    // -----------------------------------------------------------------------------------
+    void loop() {
+        if (task == NULL) {
+            process();
+        }
+        LIGHT_EVENT event;
+        while (events.pop(event)) {
+            sync(event.lamp, event.power);
+        }
+        if (unsynced.load(std::memory_order_relaxed) != 0) {
+            uint32_t mask = unsynced.exchange(0, std::memory_order_acquire);
+            for (int i = 0; i < nLamps; i++) {
+                if (mask & (1 << i)) {
+                    sync(i, lamps[i].power);
+                }
+            }
+        }
+        stateStore.loop();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // sync() method
+    //
+    // HomeSpan side: brings the characteristics and the saved state of a lamp in line with
+    // a pushbutton change
+    // -----------------------------------------------------------------------------------
+    void sync(int index, boolean power) {
+        LAMP &lamp = lamps[index];
+        if (lamp.accessory != NULL) {
+            lamp.accessory->syncPower(power);
+        }
+        stateStore.update(index, lamp.nChannels, power, NULL, NULL);
+        TRACE(TRACE_SYNC, index, power, 0);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // post() method
+    //
+    // HomeSpan side: runs a function once on the lighting side, where it can use the lamps
+    // safely. Returns false if another function is still pending
+    // -----------------------------------------------------------------------------------
+    boolean post(void (*function)()) {
+        void (*idle)() = NULL;
+        if (!job.compare_exchange_strong(idle, function)) {
+            return false;
+        }
+        if (task != NULL) {
+            xTaskNotifyGive(task);
+        }
+        return true;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // process() method
+    //
+    // lighting side: applies pending commands, classifies the pushbutton edges and runs any posted
+    // function. Light sleep is kept away while a press is being classified
+    // -----------------------------------------------------------------------------------
+    void process() {
+        applyCommands();
+        buttonManager.poll(*this);
+        if (job.load(std::memory_order_relaxed) != NULL) {
+            job.exchange(NULL)();
+        }
+        powerManager.holdButtons(buttonManager.idleTime((uint32_t) esp_timer_get_time()) != NO_DEADLINE);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // press() method
+    //
+    // lighting side: applies the dispatch entries of a press as a single scene
+    // -----------------------------------------------------------------------------------
+    void press(const BUTTON_DISPATCH *entries, int n) {
+        scene.begin();
+        for (int i = 0; i < n; i++) {
+            if (entries[i].lamp < nLamps) {
+                lamps[entries[i].lamp].stageAction(entries[i].action, scene);
+            }
+        }
+        scene.commit();
+        uint32_t now = (uint32_t) esp_timer_get_time();
+        for (int i = 0; i < n; i++) {
+            if (entries[i].lamp < nLamps) {
+                metrics.pressLatency[entries[i].lamp].record(now - buttonManager.pressTime);
+            }
+        }
+        buttonManager.measureWake(now);
+        powerManager.wake();                // HomeKit follows the pushbutton right away
+    }
+
+    // -----------------------------------------------------------------------------------
+    // applyCommands() method
+    //
+    // lighting side: applies pending commands as a single scene
+    // -----------------------------------------------------------------------------------
+    void applyCommands() {
+        LIGHT_COMMAND command;
+        uint32_t times[LIGHTING_QUEUE_SIZE];    // write times, the latency is taken once committed
+        int n;
+        do {
+            n = 0;
+            scene.begin();
+            while (n < LIGHTING_QUEUE_SIZE && commands.pop(command)) {
+                applyCommand(command, scene);
+                times[n++] = command.time;
+            }
+            scene.commit();
+            uint32_t now = (uint32_t) esp_timer_get_time();
+            for (int i = 0; i < n; i++) {
+                metrics.commandLatency.record(now - times[i]);
+            }
+        } while (n == LIGHTING_QUEUE_SIZE);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // applyCommand() method
+    //
+    // lighting side: stages one command
+    // -----------------------------------------------------------------------------------
+    void applyCommand(const LIGHT_COMMAND &command, SCENE &scene) {
+        LAMP &lamp = lamps[command.lamp];
+        if (command.effect >= 0) {
+            lamp.power = true;
+            int other = effectPlayer.lamp;
+            if (other >= 0 && other != lamp.index) {
+                lamps[other].apply(scene);  // only one effect at a time, the other lamp gets its state back
+            }
+            effectPlayer.start(command.effect, lamp.index, lamp.nChannels, lamp.channel, lamp.mix);
+        } else if (command.effect == EFFECT_STOP) {
+            lamp.apply(scene);
+        } else {
+            lamp.power = command.power;
+            for (int i = 0; i < lamp.nChannels; i++) {
+                lamp.duty[i] = command.duty[i];
+            }
+            lamp.apply(scene);
+        }
+        TRACE(TRACE_COMMAND, command.lamp, command.power, command.duty[0]);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // add() method
+    //
+    // allocates a lamp slot
+    // -----------------------------------------------------------------------------------
+    LAMP *add() {
+        if (nLamps == MAX_LAMPS) {
+            return NULL;                    // Only MAX_LAMPS lamps supported
+        }
+        LAMP *lamp = &lamps[nLamps];
+        lamp->accessory = NULL;
+        lamp->index = nLamps++;
+        lamp->relayPin = -1;
+        lamp->relayOnLevel = HIGH;
+        lamp->nChannels = 0;
+        lamp->fadeTime = FADE_TIME;
+        lamp->mix = NULL;
+        lamp->power = false;
+        lamp->events = &events;
+        lamp->unsynced = &unsynced;
+        return lamp;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // restore() method
+    //
+    // takes the saved power and duties of a lamp, lamps without a saved state stay off
+    // -----------------------------------------------------------------------------------
+    void restore(LAMP *lamp) {
+        const LAMP_STATE *state = stateStore.get(lamp->index, lamp->nChannels);
+        if (state != NULL) {
+            lamp->power = state->power;
+            for (int i = 0; i < lamp->nChannels; i++) {
+                lamp->duty[i] = state->duty[i];
+            }
+        }
+        restoreTime = (uint32_t) esp_timer_get_time();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // taskLoop() method
+    //
+    // body of the lighting task. Sleeps until a pushbutton edge, a command, a posted
+    // function or the next press timeout
+    // -----------------------------------------------------------------------------------
+    static void taskLoop(void *arg) {
+        LIGHTING *lighting = (LIGHTING *) arg;
+        for (;;) {
+            lighting->process();
+            uint32_t wait = buttonManager.idleTime((uint32_t) esp_timer_get_time());
+            ulTaskNotifyTake(pdTRUE, wait == NO_DEADLINE ? portMAX_DELAY : pdMS_TO_TICKS(wait / 1000) + 1);
+        }
+    }
+};
+
+LIGHTING lighting;                          // owns every lamp output and pushbutton
+
+#endif
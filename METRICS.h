@@ -0,0 +1,215 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <WebServer.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#define METRICS_PORT 8080           // port of the metrics page, HomeSpan owns port 80
+#define METRICS_PATH "/metrics"     // Prometheus text format
+#define METRIC_LAMPS 8              // lamps with press latency, at least MAX_LAMPS
+#define METRIC_BUCKETS 12           // histogram buckets, the last one is +Inf
+#define METRIC_LABEL_SIZE 64        // extra label of a histogram, name="value"
+#define METRIC_LINE_SIZE (METRIC_LABEL_SIZE + 128)  // one line of the page: name up to 64 chars, label and two numbers
+
+// Upper bound in us of every histogram bucket but the last one
+constexpr uint32_t metricBuckets[METRIC_BUCKETS - 1] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 50000 };
+
+// Device classes whose update() is timed
+enum METRIC_DEVICE {
+    DEVICE_LED,                     // DEV_LED
+    DEVICE_DIMMABLE_LED,            // DEV_DimmableLED
+    DEVICE_CCT_LED,                 // DEV_TunableWhiteLED
+    DEVICE_RGB_LED,                 // DEV_RgbLED
+    DEVICE_RGBW_LED,                // DEV_RgbwLED
+    DEVICE_CLASSES
+};
+
+const char *const deviceNames[DEVICE_CLASSES] = { "DEV_LED", "DEV_DimmableLED", "DEV_TunableWhiteLED", "DEV_RgbLED", "DEV_RgbwLED" };
+
+// =====================================================================================
+// HISTOGRAM: Fixed bucket latency histogram
+//
+// record() is a bucket search plus two relaxed atomic increments, safe from any task or
+// interrupt. Nothing is formatted until the page is requested.
+// =====================================================================================
+struct HISTOGRAM {
+
+    std::atomic<uint32_t> counts[METRIC_BUCKETS];   // samples per bucket, not cumulative
+    std::atomic<uint32_t> sum{0};                   // sum of the samples in us, wraps like a counter
+
+    HISTOGRAM() {
+        for (int i = 0; i < METRIC_BUCKETS; i++) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // record() method
+    //
+    // adds a sample in us
+    // -----------------------------------------------------------------------------------
+    void record(uint32_t us) {
+        int i = 0;
+        while (i < METRIC_BUCKETS - 1 && us > metricBuckets[i]) {
+            i++;
+        }
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(us, std::memory_order_relaxed);
+    }
+};
+
+// =====================================================================================
+// SCOPED_TIMER: Records in a histogram the time spent in the enclosing scope
+// =====================================================================================
+struct SCOPED_TIMER {
+
+    HISTOGRAM &histogram;                       // where the time goes
+    uint32_t start;                             // esp_timer time in us
+
+    SCOPED_TIMER(HISTOGRAM &histogram) : histogram(histogram), start((uint32_t) esp_timer_get_time()) {}
+    ~SCOPED_TIMER() {
+        histogram.record((uint32_t) esp_timer_get_time() - start);
+    }
+};
+
+// =====================================================================================
+// METRICS: Counters and latency histograms of the controller, served as Prometheus text
+//          on METRICS_PORT once WiFi is up
+// =====================================================================================
+struct METRICS {
+
+    HISTOGRAM loopTime;                         // loop() iteration
+    HISTOGRAM pressLatency[METRIC_LAMPS];       // press decided to lamp output, per lamp
+    HISTOGRAM updateTime[DEVICE_CLASSES];       // HomeKit write handed to the lighting engine, per device class
+    HISTOGRAM commandLatency;                   // HomeKit write to lamp output
+    HISTOGRAM wakeLatency;                      // press delay added by the controller, wake up to relay commit
+    std::atomic<uint32_t> droppedEdges{0};      // pushbutton edges lost on a full queue
+    std::atomic<uint32_t> droppedCommands{0};   // HomeKit writes lost on a full queue
+    std::atomic<uint32_t> droppedEvents{0};     // pushbutton changes not queued to HomeSpan, resynchronized from the lamps
+    const char *lampNames[METRIC_LAMPS] = {};   // accessory names, labels of the press latency
+    WebServer *server = NULL;                   // created when WiFi connects
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // starts the page as soon as WiFi is connected. Must be called from setup()
+    // -----------------------------------------------------------------------------------
+    void begin() {
+        homeSpan.setWifiCallback(startServer);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // loop() method
+    //
+    // serves the page, must be called from loop()
+    // -----------------------------------------------------------------------------------
+    void loop() {
+        if (server != NULL) {
+            server->handleClient();
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // startServer() method
+    //
+    // HomeSpan WiFi callback
+    // -----------------------------------------------------------------------------------
+    static void startServer();
+
+    // -----------------------------------------------------------------------------------
+    // sendPage() method
+    //
+    // WebServer handler, writes every metric
+    // -----------------------------------------------------------------------------------
+    static void sendPage();
+
+    // -----------------------------------------------------------------------------------
+    // sendHistogram() method
+    //
+    // writes one histogram as cumulative buckets, sum and count
+    // name             metric name
+    // label            extra label as name="value", shorter than METRIC_LABEL_SIZE, NULL if none
+    // -----------------------------------------------------------------------------------
+    void sendHistogram(const HISTOGRAM &histogram, const char *name, const char *label) {
+        char line[METRIC_LINE_SIZE];
+        const char *sep = label != NULL ? "," : "";
+        label = label != NULL ? label : "";
+        uint32_t count = 0;
+        for (int i = 0; i < METRIC_BUCKETS; i++) {
+            count += histogram.counts[i].load(std::memory_order_relaxed);
+            if (i < METRIC_BUCKETS - 1) {
+                snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%u\"} %u\n", name, label, sep, metricBuckets[i], count);
+            } else {
+                snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %u\n", name, label, sep, count);
+            }
+            server->sendContent(line);
+        }
+        const char *open = *label ? "{" : "";
+        const char *close = *label ? "}" : "";
+        snprintf(line, sizeof(line), "%s_sum%s%s%s %u\n", name, open, label, close, histogram.sum.load(std::memory_order_relaxed));
+        server->sendContent(line);
+        snprintf(line, sizeof(line), "%s_count%s%s%s %u\n", name, open, label, close, count);
+        server->sendContent(line);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // sendValue() method
+    //
+    // writes one counter or gauge
+    // -----------------------------------------------------------------------------------
+    void sendValue(const char *name, const char *type, uint32_t value) {
+        char line[METRIC_LINE_SIZE];
+        snprintf(line, sizeof(line), "# TYPE %s %s\n%s %u\n", name, type, name, value);
+        server->sendContent(line);
+    }
+};
+
+METRICS metrics;                            // controller instrumentation
+
+void METRICS::startServer() {
+    if (metrics.server != NULL) {
+        return;
+    }
+    metrics.server = new WebServer(METRICS_PORT);
+    metrics.server->on(METRICS_PATH, HTTP_GET, sendPage);
+    metrics.server->begin();
+    LOG1("Metrics available on port %d, path %s\n", METRICS_PORT, METRICS_PATH);
+}
+
+void METRICS::sendPage() {
+    WebServer *server = metrics.server;
+    char label[METRIC_LABEL_SIZE];
+    server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server->send(200, "text/plain; version=0.0.4", "");
+    server->sendContent("# TYPE bedlight_loop_duration_us histogram\n");
+    metrics.sendHistogram(metrics.loopTime, "bedlight_loop_duration_us", NULL);
+    server->sendContent("# TYPE bedlight_press_latency_us histogram\n");
+    for (int i = 0; i < METRIC_LAMPS; i++) {
+        if (metrics.lampNames[i] != NULL) {
+            snprintf(label, sizeof(label), "lamp=\"%s\"", metrics.lampNames[i]);
+            metrics.sendHistogram(metrics.pressLatency[i], "bedlight_press_latency_us", label);
+        }
+    }
+    server->sendContent("# TYPE bedlight_update_duration_us histogram\n");
+    for (int i = 0; i < DEVICE_CLASSES; i++) {
+        snprintf(label, sizeof(label), "device=\"%s\"", deviceNames[i]);
+        metrics.sendHistogram(metrics.updateTime[i], "bedlight_update_duration_us", label);
+    }
+    server->sendContent("# TYPE bedlight_command_latency_us histogram\n");
+    metrics.sendHistogram(metrics.commandLatency, "bedlight_command_latency_us", NULL);
+    server->sendContent("# HELP bedlight_wake_latency_us Pushbutton press from chip wake up to outputs committed, press type wait excluded\n");
+    server->sendContent("# TYPE bedlight_wake_latency_us histogram\n");
+    metrics.sendHistogram(metrics.wakeLatency, "bedlight_wake_latency_us", NULL);
+    metrics.sendValue("bedlight_dropped_edges_total", "counter", metrics.droppedEdges.load(std::memory_order_relaxed));
+    metrics.sendValue("bedlight_dropped_commands_total", "counter", metrics.droppedCommands.load(std::memory_order_relaxed));
+    metrics.sendValue("bedlight_dropped_events_total", "counter", metrics.droppedEvents.load(std::memory_order_relaxed));
+    metrics.sendValue("bedlight_heap_free_bytes", "gauge", heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+    metrics.sendValue("bedlight_heap_min_free_bytes", "gauge", heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    metrics.sendValue("bedlight_heap_largest_free_block_bytes", "gauge", heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+    metrics.sendValue("bedlight_uptime_seconds", "counter", (uint32_t) (esp_timer_get_time() / 1000000));
+    server->sendContent("");
+}
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include "esp_pm.h"
+#include "esp_wifi.h"
+#include "FADER.h"
+#include "BUTTON_MANAGER.h"
+#include "TRACE.h"
+
+#define POWER_USE_LIGHT_SLEEP true  // automatic light sleep when idle, false for modem sleep only
+#define POWER_MAX_MHZ 240           // CPU frequency when busy
+#define POWER_MIN_MHZ 80            // CPU frequency when idle, APB stays at 80 MHz
+#define POWER_WAKE_BOUND_US 3000    // press wake up to relay commit, one lighting task tick included, light sleep is given up above it
+#define POWER_WAKE_STRIKES 3        // presses over POWER_WAKE_BOUND_US before light sleep is given up
+#define POWER_HOMEKIT_BOUND_MS 20   // longest loop() pause when idle, added to the HomeKit response time
+#define POWER_ACTIVE_HOLD_MS 2000   // loop() keeps running this long after any lamp change
+#define POWER_WIFI_RETRY 1000       // ms between two attempts to set WiFi modem sleep
+#define POWER_REPORT_INTERVAL 900000    // ms between two residency reports
+#define POWER_ACTIVE_MA 100         // estimated mean supply current of each state in mA, WiFi connected
+#define POWER_MODEM_SLEEP_MA 30
+#define POWER_LIGHT_SLEEP_MA 15
+
+static_assert(!POWER_USE_LIGHT_SLEEP || PWM_SLEEP_CLOCK, "PWM outputs stop in light sleep without PWM_SLEEP_CLOCK");
+
+// States of the controller, as seen from loop()
+enum POWER_STATE {
+    POWER_ACTIVE,                   // loop() running flat out
+    POWER_MODEM_SLEEP,              // loop() waiting, WiFi modem sleep, light sleep not allowed
+    POWER_LIGHT_SLEEP,              // loop() waiting, automatic light sleep allowed
+    POWER_STATES
+};
+
+const char *const powerStateNames[POWER_STATES] = { "active", "modem sleep", "light sleep" };
+constexpr uint32_t powerStateCurrent[POWER_STATES] = { POWER_ACTIVE_MA, POWER_MODEM_SLEEP_MA, POWER_LIGHT_SLEEP_MA };
+
+// =====================================================================================
+// POWER_MANAGER: Lets the controller sleep while nothing happens
+//
+// loop() keeps running flat out for POWER_ACTIVE_HOLD_MS after any lamp change, so slider
+// drags and pushbutton synchronization are served at once. Afterwards it waits up to
+// POWER_HOMEKIT_BOUND_MS between two homeSpan.poll(), or until the lighting side wakes
+// it. loop() and the classification of a press run at POWER_MAX_MHZ, both hold a
+// ESP_PM_CPU_FREQ_MAX lock, which keeps light sleep away as well. The fader only holds
+// light sleep off, its frames are short and an effect keeps it running for half an hour.
+// With every task waiting, the CPU drops to POWER_MIN_MHZ with WiFi in modem sleep and,
+// when the fader is stopped and no press is being classified, enters automatic light
+// sleep between WiFi beacons. The pushbutton pins wake it and the PWM outputs keep
+// running from RTC8M, at PWM_SLEEP_FREQUENCY and PWM_SLEEP_BITS, see PWM_STAGE. Presses
+// that take longer than POWER_WAKE_BOUND_US from the wake up to the relay commit, see
+// BUTTON_MANAGER::measureWake(), turn light sleep off for good. The wake up is taken
+// when the CPU leaves light sleep (with CONFIG_PM_LIGHT_SLEEP_CALLBACKS, the edge
+// interrupt otherwise), oscillator start up before it is not measured. Time spent in
+// every state and the estimated mean current are logged every POWER_REPORT_INTERVAL.
+// =====================================================================================
+struct POWER_MANAGER {
+
+    TaskHandle_t loopTask = NULL;               // task running loop()
+    esp_pm_lock_handle_t loopLock = NULL;       // POWER_MAX_MHZ and no light sleep while loop() runs
+    esp_pm_lock_handle_t buttonLock = NULL;     // POWER_MAX_MHZ and no light sleep while a press is being classified
+    boolean loopHeld = false;                   // true while loopLock is taken
+    boolean buttonHeld = false;                 // true while buttonLock is taken, lighting side
+    boolean lightSleep = false;                 // true while automatic light sleep is configured
+    boolean modemSleep = false;                 // true once WiFi modem sleep is set
+    volatile uint32_t activityTime = 0;         // ms of the last lamp change
+    uint32_t wifiTime = 0;                      // ms of the last modem sleep attempt
+    uint32_t markTime = 0;                      // us the residency was last updated
+    uint32_t reportTime = 0;                    // ms of the last report
+    uint64_t residency[POWER_STATES] = {};      // us spent in each state since the last report
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // sets up power management. Must be called at the end of setup(), after
+    // lighting.begin()
+    // -----------------------------------------------------------------------------------
+    void begin() {
+        loopTask = xTaskGetCurrentTaskHandle();
+        if (buttonManager.notify == NULL) {
+            buttonManager.notify = loopTask;    // lighting runs from loop(), edges must wake it
+        }
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "loop", &loopLock);
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "buttons", &buttonLock);
+        holdLoop(true);
+        esp_pm_config_esp32_t config = {};
+        config.max_freq_mhz = POWER_MAX_MHZ;
+        config.min_freq_mhz = POWER_MIN_MHZ;
+        config.light_sleep_enable = POWER_USE_LIGHT_SLEEP;
+        esp_err_t err = esp_pm_configure(&config);
+        if (err != ESP_OK && config.light_sleep_enable) {
+            config.light_sleep_enable = false;  // tickless idle not built in, frequency scaling only
+            err = esp_pm_configure(&config);
+        }
+        lightSleep = err == ESP_OK && config.light_sleep_enable;
+        if (lightSleep) {
+            buttonManager.wakeBound = POWER_WAKE_BOUND_US;
+            buttonManager.enableWakeup();
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+            esp_pm_sleep_cbs_register_config_t callbacks = {};
+            callbacks.exit_cb = onSleepExit;
+            esp_pm_light_sleep_register_cbs(&callbacks);
+#endif
+            pwmStage.useSleepClock(true);   // loop() holds light sleep off until the fader switched it
+            fader.start();
+        }
+        if (err == ESP_OK) {
+            WEBLOG("Power management: %d-%d MHz, %s when idle, PWM %d bits at %d Hz", POWER_MIN_MHZ, POWER_MAX_MHZ, lightSleep ? "light sleep" : "modem sleep",
+                   lightSleep ? PWM_SLEEP_BITS : PWM_BITS, lightSleep ? PWM_SLEEP_FREQUENCY : PWM_FREQUENCY);
+        } else {
+            WEBLOG("Power management not available, modem sleep only");
+        }
+        markTime = (uint32_t) esp_timer_get_time();
+        reportTime = activityTime = millis();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // touch() method
+    //
+    // HomeSpan side: a lamp changed, loop() must keep running
+    // -----------------------------------------------------------------------------------
+    void touch() {
+        activityTime = millis();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // wake() method
+    //
+    // lighting side: a pushbutton changed a lamp, loop() must synchronize HomeKit now
+    // -----------------------------------------------------------------------------------
+    void wake() {
+        activityTime = millis();
+        if (loopTask != NULL && loopTask != xTaskGetCurrentTaskHandle()) {
+            xTaskNotifyGive(loopTask);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // holdButtons() method
+    //
+    // lighting side: keeps the CPU at POWER_MAX_MHZ and light sleep away while a press is
+    // being classified, so the following edges are served without waking up
+    // -----------------------------------------------------------------------------------
+    void holdButtons(boolean pending) {
+        if (pending != buttonHeld && buttonLock != NULL) {
+            buttonHeld = pending;
+            pending ? esp_pm_lock_acquire(buttonLock) : esp_pm_lock_release(buttonLock);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // idle() method
+    //
+    // must be called at the end of loop(). Waits when there is nothing to do, until the
+    // next press timeout when the lighting engine runs from loop(), and keeps the
+    // residency. Only the wait runs at POWER_MIN_MHZ
+    // -----------------------------------------------------------------------------------
+    void idle() {
+        uint32_t now = (uint32_t) esp_timer_get_time();
+        residency[POWER_ACTIVE] += now - markTime;
+        markTime = now;
+        if (!modemSleep && millis() - wifiTime >= POWER_WIFI_RETRY) {
+            wifiTime = millis();
+            modemSleep = esp_wifi_set_ps(WIFI_PS_MIN_MODEM) == ESP_OK;     // fails until WiFi is started
+        }
+        if (lightSleep && buttonManager.slowWakes.load(std::memory_order_relaxed) >= POWER_WAKE_STRIKES) {
+            disableLightSleep();
+        }
+        if (millis() - reportTime >= POWER_REPORT_INTERVAL) {
+            report();
+        }
+        if (millis() - activityTime < POWER_ACTIVE_HOLD_MS) {
+            holdLoop(true);
+            return;
+        }
+        POWER_STATE state = lightSleep && !fader.isFading() && !buttonHeld ? POWER_LIGHT_SLEEP : POWER_MODEM_SLEEP;
+        uint32_t wait = POWER_HOMEKIT_BOUND_MS * 1000;
+        if (buttonManager.notify == loopTask) {
+            uint32_t deadline = buttonManager.idleTime(now);    // lighting runs from loop(), press timeouts are served here
+            wait = deadline < wait ? deadline : wait;
+        }
+        holdLoop(false);
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS((wait + 999) / 1000));
+        holdLoop(true);
+        now = (uint32_t) esp_timer_get_time();
+        residency[state] += now - markTime;
+        markTime = now;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // holdLoop() method
+    //
+    // takes or gives back the frequency lock of loop()
+    // -----------------------------------------------------------------------------------
+    void holdLoop(boolean busy) {
+        if (busy != loopHeld && loopLock != NULL) {
+            loopHeld = busy;
+            busy ? esp_pm_lock_acquire(loopLock) : esp_pm_lock_release(loopLock);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // disableLightSleep() method
+    //
+    // keeps frequency scaling and modem sleep only, wall presses took too long to reach the outputs
+    // -----------------------------------------------------------------------------------
+    void disableLightSleep() {
+        esp_pm_config_esp32_t config = {};
+        config.max_freq_mhz = POWER_MAX_MHZ;
+        config.min_freq_mhz = POWER_MIN_MHZ;
+        config.light_sleep_enable = false;
+        esp_pm_configure(&config);
+        lightSleep = false;
+        pwmStage.useSleepClock(false);      // full PWM resolution again
+        fader.start();
+        WEBLOG("%d presses took more than %d us from wake up to outputs, light sleep disabled", POWER_WAKE_STRIKES, POWER_WAKE_BOUND_US);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // onSleepExit() method
+    //
+    // light sleep exit callback, notes when the pushbuttons woke the chip so the press
+    // latency starts there
+    // -----------------------------------------------------------------------------------
+    static esp_err_t ARDUINO_ISR_ATTR onSleepExit(int64_t sleepTime, void *arg) {
+        if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+            buttonManager.wakeTime.store((uint32_t) esp_timer_get_time() | 1);     // never 0
+        }
+        return ESP_OK;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // report() method
+    //
+    // logs the time spent in every state and the estimated mean current since the last
+    // report, then starts over
+    // -----------------------------------------------------------------------------------
+    void report() {
+        uint64_t total = 0;
+        uint64_t idle = 0;
+        uint64_t charge = 0;                // mA * us
+        uint64_t idleCharge = 0;
+        for (int i = 0; i < POWER_STATES; i++) {
+            total += residency[i];
+            charge += residency[i] * powerStateCurrent[i];
+            if (i != POWER_ACTIVE) {
+                idle += residency[i];
+                idleCharge += residency[i] * powerStateCurrent[i];
+            }
+        }
+        if (total > 0) {
+            LIGHT_LOG1("Power: %s %u%%, %s %u%%, %s %u%%, about %u mA mean, %u mA when idle\n",
+                       powerStateNames[POWER_ACTIVE], (uint32_t) (residency[POWER_ACTIVE] * 100 / total),
+                       powerStateNames[POWER_MODEM_SLEEP], (uint32_t) (residency[POWER_MODEM_SLEEP] * 100 / total),
+                       powerStateNames[POWER_LIGHT_SLEEP], (uint32_t) (residency[POWER_LIGHT_SLEEP] * 100 / total),
+                       (uint32_t) (charge / total), idle > 0 ? (uint32_t) (idleCharge / idle) : 0);
+        }
+        for (int i = 0; i < POWER_STATES; i++) {
+            residency[i] = 0;
+        }
+        reportTime = millis();
+    }
+};
+
+POWER_MANAGER powerManager;                 // idle scheduling and sleep modes
+
+#endif
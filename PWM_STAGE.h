@@ -0,0 +1,225 @@
+#ifndef PWM_STAGE_H
+#define PWM_STAGE_H
+
+#include <atomic>
+#include "driver/ledc.h"
+#include "esp_sleep.h"
+#include "soc/ledc_struct.h"
+#include "COLOR.h"
+
+#define PWM_FREQUENCY 5000          // PWM frequency in Hz, as the HomeSpan LedPin default
+#define PWM_BITS 13                 // LEDC resolution from APB, the most it allows at PWM_FREQUENCY
+#define PWM_SLEEP_CLOCK true        // clock LEDC from RTC8M while light sleep is enabled, so the outputs keep running
+#define PWM_SLEEP_BITS 12           // LEDC resolution from RTC8M, 12 at least for the dimmest steps, 10 would keep PWM_FREQUENCY with 4 times coarser steps
+#define PWM_SLEEP_FREQUENCY 1900    // PWM frequency in Hz from RTC8M, at most PWM_SLEEP_CLOCK_HZ >> PWM_SLEEP_BITS
+#define PWM_SLEEP_CLOCK_HZ 8000000  // RTC8M frequency
+#define PWM_MODE LEDC_LOW_SPEED_MODE    // only low speed channels can run from RTC8M
+#define PWM_TIMER LEDC_TIMER_3      // shared by every output, HomeSpan LedPins take the timers from 0
+#define PWM_FIRST_CHANNEL 7         // outputs take the LEDC channels downwards, LedPins take them upwards
+#define PWM_LATCH_GUARD 16          // no latch is started in the last 1/PWM_LATCH_GUARD of the period, 12.5 us
+#define PWM_PHASE_SHIFT true        // spread the channels of a lamp over the period
+#define MAX_PWM_OUTPUTS 8           // LEDC channels of one speed mode
+
+static_assert((PWM_SLEEP_CLOCK_HZ >> PWM_SLEEP_BITS) >= PWM_SLEEP_FREQUENCY, "RTC8M too slow for PWM_SLEEP_BITS at PWM_SLEEP_FREQUENCY");
+
+// =====================================================================================
+// PWM_STAGE: Double buffered output stage for the LEDC channels
+//
+// Every output runs on PWM_TIMER, so they all share the same period boundaries. Duties
+// are first staged, nothing reaches the hardware, and latch() then loads every staged
+// duty and requests the update of all of them back to back. LEDC applies a requested
+// duty at the next period boundary, so a latch started early enough in the period
+// lands on the same boundary for every channel and a colour change never shows half
+// old and half new. Each output may start its pulse at its own phase (LEDC hpoint) so
+// the channels of a strip do not switch their current on the same edge.
+// The timer runs from APB with PWM_BITS of resolution. Only once light sleep is actually
+// enabled it is switched to RTC8M, kept powered in light sleep. 8 MHz can not give the
+// resolution of the dimmest steps at PWM_FREQUENCY, so the PWM frequency drops to
+// PWM_SLEEP_FREQUENCY instead, still far above visible flicker, with PWM_SLEEP_BITS.
+// Only used from the fader timer once the lamps are created, clock switches included.
+// =====================================================================================
+struct PWM_STAGE {
+
+    struct PWM_OUTPUT {
+        ledc_channel_t channel;                 // LEDC channel
+        uint16_t phase;                         // pulse start [0,DUTY_MAX], fraction of the period
+        uint16_t duty;                          // staged duty [0,DUTY_MAX]
+    };
+
+    PWM_OUTPUT outputs[MAX_PWM_OUTPUTS];        // configured outputs
+    int nOutputs = 0;                           // output counter
+    uint32_t dirty = 0;                         // bit mask of the outputs staged since the last latch
+    uint32_t latches = 0;                       // latches done since boot
+    uint32_t deferred = 0;                      // latches that waited for the next period
+    uint32_t bits = PWM_BITS;                   // LEDC resolution of the current clock
+    boolean sleepClock = false;                 // true while LEDC runs from RTC8M
+    std::atomic<int8_t> clockRequest{-1};       // clock for the next latch, 1 RTC8M, 0 APB, -1 no change
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    // -----------------------------------------------------------------------------------
+    // addOutput() method
+    //
+    // configures a LEDC channel on a pin and returns its output index or -1 if there is
+    // no room
+    // pin              output pin
+    // inverted         true if the output is active low
+    // duty             initial duty [0,DUTY_MAX]
+    // phase            pulse start [0,DUTY_MAX], fraction of the period
+    // -----------------------------------------------------------------------------------
+    int addOutput(int pin, boolean inverted, uint16_t duty, uint16_t phase) {
+        if (nOutputs == MAX_PWM_OUTPUTS) {
+            return -1;                      // Only MAX_PWM_OUTPUTS outputs supported
+        }
+        if (nOutputs == 0) {
+            configTimer();
+        }
+        PWM_OUTPUT &output = outputs[nOutputs];
+        output.channel = (ledc_channel_t) (PWM_FIRST_CHANNEL - nOutputs);
+        output.phase = phase;
+        output.duty = duty;
+        ledc_channel_config_t channel = {};
+        channel.gpio_num = pin;
+        channel.speed_mode = PWM_MODE;
+        channel.channel = output.channel;
+        channel.timer_sel = PWM_TIMER;
+        channel.duty = Duty2Ticks(duty);
+        channel.hpoint = hpoint(output);
+        channel.flags.output_invert = inverted;
+        ledc_channel_config(&channel);
+        return nOutputs++;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // stage() method
+    //
+    // sets the duty of an output for the next latch
+    // output           output index returned by addOutput()
+    // duty             duty [0,DUTY_MAX]
+    // -----------------------------------------------------------------------------------
+    void stage(int output, uint16_t duty) {
+        if (output < 0 || output >= nOutputs) {
+            return;
+        }
+        if (duty != outputs[output].duty) {
+            outputs[output].duty = duty;
+            dirty |= 1 << output;
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // latch() method
+    //
+    // sends every staged duty so they are all shown from the same period boundary. A
+    // latch that could straddle a boundary waits for the next period, 1/PWM_LATCH_GUARD
+    // of it at most. A requested clock switch is done first
+    // -----------------------------------------------------------------------------------
+    void latch() {
+        if (clockRequest.load(std::memory_order_relaxed) >= 0) {
+            switchClock(clockRequest.exchange(-1) == 1);
+        }
+        if (dirty == 0) {
+            return;
+        }
+        for (int i = 0; i < nOutputs; i++) {
+            if (dirty & (1 << i)) {
+                ledc_set_duty_with_hpoint(PWM_MODE, outputs[i].channel, Duty2Ticks(outputs[i].duty), hpoint(outputs[i]));
+            }
+        }
+        uint32_t guard = (1 << bits) - (1 << bits) / PWM_LATCH_GUARD;
+        portENTER_CRITICAL(&mux);
+        if (timerCount() >= guard) {
+            deferred++;
+            while (timerCount() >= guard) {
+            }
+        }
+        for (int i = 0; i < nOutputs; i++) {
+            if (dirty & (1 << i)) {
+                ledc_update_duty(PWM_MODE, outputs[i].channel);
+            }
+        }
+        portEXIT_CRITICAL(&mux);
+        dirty = 0;
+        latches++;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // useSleepClock() method
+    //
+    // asks for the LEDC clock, RTC8M when light sleep is enabled. The switch is done by
+    // the next latch(), the caller must make sure the fader runs a frame
+    // -----------------------------------------------------------------------------------
+    void useSleepClock(boolean sleep) {
+        clockRequest.store(sleep);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // switchClock() method
+    //
+    // moves the timer to another clock, resolution and frequency. Every output is given its duty in
+    // the new resolution first, the timer restart then shows them from its first period
+    // -----------------------------------------------------------------------------------
+    void switchClock(boolean sleep) {
+        if (sleep == sleepClock) {
+            return;
+        }
+        sleepClock = sleep;
+        bits = sleep ? PWM_SLEEP_BITS : PWM_BITS;
+        if (nOutputs == 0) {
+            return;                         // the timer is configured by the first output
+        }
+        for (int i = 0; i < nOutputs; i++) {
+            ledc_set_duty_with_hpoint(PWM_MODE, outputs[i].channel, Duty2Ticks(outputs[i].duty), hpoint(outputs[i]));
+            ledc_update_duty(PWM_MODE, outputs[i].channel);
+        }
+        configTimer();
+        dirty = 0;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // configTimer() method
+    //
+    // configures PWM_TIMER for the current clock, RTC8M is kept powered in light sleep
+    // only while it is used
+    // -----------------------------------------------------------------------------------
+    void configTimer() {
+        ledc_timer_config_t timer = {};
+        timer.speed_mode = PWM_MODE;
+        timer.duty_resolution = (ledc_timer_bit_t) bits;
+        timer.timer_num = PWM_TIMER;
+        timer.freq_hz = sleepClock ? PWM_SLEEP_FREQUENCY : PWM_FREQUENCY;
+        timer.clk_cfg = sleepClock ? LEDC_USE_RTC8M_CLK : LEDC_USE_APB_CLK;
+        esp_sleep_pd_config(ESP_PD_DOMAIN_RTC8M, sleepClock ? ESP_PD_OPTION_ON : ESP_PD_OPTION_AUTO);
+        ledc_timer_config(&timer);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // timerCount() method
+    //
+    // returns the position of PWM_TIMER in its period, in ticks
+    // -----------------------------------------------------------------------------------
+    static uint32_t timerCount() {
+        return LEDC.timer_group[PWM_MODE].timer[PWM_TIMER].value.timer_cnt;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // hpoint() method
+    //
+    // returns the tick where the pulse of an output starts
+    // -----------------------------------------------------------------------------------
+    uint32_t hpoint(const PWM_OUTPUT &output) {
+        return Duty2Ticks(output.phase) & ((1 << bits) - 1);
+    }
+
+    // -----------------------------------------------------------------------------------
+    // Duty2Ticks() method
+    //
+    // returns the LEDC duty of a [0,DUTY_MAX] intensity, the whole period is full on
+    // -----------------------------------------------------------------------------------
+    uint32_t Duty2Ticks(uint16_t duty) {
+        return (((uint32_t) duty << bits) + DUTY_MAX / 2) / DUTY_MAX;
+    }
+};
+
+PWM_STAGE pwmStage;                         // LEDC outputs of every PWM lamp
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "soc/gpio_reg.h"
+
+// =====================================================================================
+// SCENE: Collects the output changes of several accessories and applies them in one pass
+//
+// Relays are accumulated in the GPIO set/clear masks and written with one register
+// access per GPIO bank. PWM lamps are staged on the fader and land together on its
+// next frame. Characteristics are synchronized from loop() afterwards and HomeSpan
+// flushes its notification queue once per poll(), so every controller gets a single
+// event message with all the characteristics that changed.
+// =====================================================================================
+struct SCENE {
+
+    uint32_t setMask[2] = {0, 0};               // pins to be driven HIGH, bank 0 (GPIO 0-31) and bank 1 (GPIO 32-39)
+    uint32_t clearMask[2] = {0, 0};             // pins to be driven LOW
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // starts a new scene discarding any staged output
+    // -----------------------------------------------------------------------------------
+    void begin() {
+        setMask[0] = setMask[1] = 0;
+        clearMask[0] = clearMask[1] = 0;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // setRelay() method
+    //
+    // stages the level of a relay output
+    // pin              output pin
+    // level            HIGH or LOW
+    // -----------------------------------------------------------------------------------
+    void setRelay(int pin, int level) {
+        uint32_t bit = 1UL << (pin & 31);
+        int bank = pin >> 5;
+        if (level) {
+            setMask[bank] |= bit;
+            clearMask[bank] &= ~bit;
+        } else {
+            clearMask[bank] |= bit;
+            setMask[bank] &= ~bit;
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // commit() method
+    //
+    // applies all the staged relay outputs at once
+    // -----------------------------------------------------------------------------------
+    void commit() {
+        REG_WRITE(GPIO_OUT_W1TS_REG, setMask[0]);
+        REG_WRITE(GPIO_OUT_W1TC_REG, clearMask[0]);
+        REG_WRITE(GPIO_OUT1_W1TS_REG, setMask[1]);
+        REG_WRITE(GPIO_OUT1_W1TC_REG, clearMask[1]);
+        begin();
+    }
+};
+
+#endif
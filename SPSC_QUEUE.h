@@ -0,0 +1,53 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+
+// =====================================================================================
+// SPSC_QUEUE: Lock free single producer, single consumer ring buffer
+//
+// One task (or ISR) pushes, one task pops. Each side only writes its own index, the
+// other index is read with acquire semantics so the item copy is visible before the
+// index that publishes it. SIZE must be a power of two.
+// =====================================================================================
+template <typename T, uint32_t SIZE>
+struct SPSC_QUEUE {
+
+    static_assert((SIZE & (SIZE - 1)) == 0, "SPSC_QUEUE size must be a power of two");
+
+    T items[SIZE];                              // ring storage
+    std::atomic<uint32_t> head{0};              // next slot to be written, owned by the producer
+    std::atomic<uint32_t> tail{0};              // next slot to be read, owned by the consumer
+
+    // -----------------------------------------------------------------------------------
+    // push() method
+    //
+    // producer side, returns false if the queue is full
+    // -----------------------------------------------------------------------------------
+    boolean push(const T &item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == SIZE) {
+            return false;
+        }
+        items[h & (SIZE - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // pop() method
+    //
+    // consumer side, returns false if the queue is empty
+    // -----------------------------------------------------------------------------------
+    boolean pop(T &item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t) {
+            return false;
+        }
+        item = items[t & (SIZE - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef STATE_STORE_H
+#define STATE_STORE_H
+
+#include <Preferences.h>
+#include "TRACE.h"
+
+#define MAX_STORED_LAMPS 8          // lamp states kept in NVS, at least MAX_LAMPS
+#define MAX_STORED_VALUES 4         // characteristic values and duties per lamp
+#define STATE_STORE_VERSION 2       // bump when LAMP_STATE changes, old records are ignored
+#define STATE_STORE_DELAY 5000      // ms without changes before the state is written
+#define STATE_STORE_INTERVAL 60000  // minimum ms between two writes
+#define STATE_STORE_NAMESPACE "lighting"
+#define STATE_STORE_KEY "lamps"
+
+// =====================================================================================
+// LAMP_STATE: What is needed to bring a lamp back after a reset
+// =====================================================================================
+struct LAMP_STATE {
+    uint8_t channels;                           // PWM channels of the lamp, restore only if they match
+    uint8_t power;                              // 1 if the lamp was on
+    uint16_t duty[MAX_STORED_VALUES];           // PWM duties when on
+    uint16_t value[MAX_STORED_VALUES];          // characteristic values (brightness or hue, saturation, brightness)
+};
+
+// =====================================================================================
+// STATE_STORE: Last lamp states, persisted in NVS
+//
+// The whole set is one blob read once at boot, before HomeSpan or WiFi start, so the
+// outputs come back as they were. Changes only mark the set dirty. It is written once
+// nothing changed for STATE_STORE_DELAY, at most every STATE_STORE_INTERVAL and only
+// if it differs from what is already stored, so a burst of toggles costs one write
+// and NVS spreads those over its pages.
+// Only used from the HomeSpan side.
+// =====================================================================================
+struct STATE_STORE {
+
+    struct RECORD {
+        uint8_t version;                        // STATE_STORE_VERSION
+        uint8_t nLamps;                         // lamps with a valid state
+        LAMP_STATE lamps[MAX_STORED_LAMPS];
+    };
+
+    RECORD current = {};                        // state being shown
+    RECORD stored = {};                         // state in NVS
+    boolean restored = false;                   // true if a valid record was read at boot
+    boolean dirty = false;                      // true if current has changes not written yet
+    uint32_t changeTime = 0;                    // ms of the last change
+    uint32_t writeTime = 0;                     // ms of the last write attempt
+    uint32_t writes = 0;                        // NVS writes since boot
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // reads the stored states, must be called first thing in setup()
+    // -----------------------------------------------------------------------------------
+    void begin() {
+        Preferences nvs;
+        current.version = STATE_STORE_VERSION;
+        if (nvs.begin(STATE_STORE_NAMESPACE, true)) {
+            restored = nvs.getBytesLength(STATE_STORE_KEY) == sizeof(RECORD) &&
+                       nvs.getBytes(STATE_STORE_KEY, &stored, sizeof(RECORD)) == sizeof(RECORD) &&
+                       stored.version == STATE_STORE_VERSION && stored.nLamps <= MAX_STORED_LAMPS;
+            nvs.end();
+        }
+        if (restored) {
+            current = stored;
+        } else {
+            stored = current;
+        }
+        writeTime = millis() - STATE_STORE_INTERVAL;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // get() method
+    //
+    // returns the state saved for a lamp, NULL if there is none or it was saved for a
+    // lamp with a different number of channels
+    // lamp             lamp index
+    // channels         PWM channels of the lamp, 0 for relays
+    // -----------------------------------------------------------------------------------
+    const LAMP_STATE *get(int lamp, int channels) {
+        if (lamp >= current.nLamps || current.lamps[lamp].channels != channels) {
+            return NULL;
+        }
+        return &current.lamps[lamp];
+    }
+
+    // -----------------------------------------------------------------------------------
+    // update() method
+    //
+    // takes the new state of a lamp, written later by loop()
+    // lamp             lamp index
+    // channels         PWM channels of the lamp, 0 for relays
+    // power            true if the lamp is on
+    // duty             PWM duties when on, NULL to keep the stored ones
+    // value            characteristic values, NULL to keep the stored ones
+    // -----------------------------------------------------------------------------------
+    void update(int lamp, int channels, boolean power, const uint16_t *duty, const uint16_t *value) {
+        if (lamp >= MAX_STORED_LAMPS) {
+            return;
+        }
+        while (current.nLamps <= lamp) {
+            current.lamps[current.nLamps++] = {};
+        }
+        LAMP_STATE &state = current.lamps[lamp];
+        state.channels = channels;
+        state.power = power;
+        for (int i = 0; i < MAX_STORED_VALUES; i++) {
+            if (duty != NULL) {
+                state.duty[i] = i < channels ? duty[i] : 0;
+            }
+            if (value != NULL) {
+                state.value[i] = value[i];
+            }
+        }
+        dirty = true;
+        changeTime = millis();
+    }
+
+    // -----------------------------------------------------------------------------------
+    // loop() method
+    //
+    // writes the pending changes once they have settled
+    // -----------------------------------------------------------------------------------
+    void loop() {
+        uint32_t now = millis();
+        if (!dirty || now - changeTime < STATE_STORE_DELAY || now - writeTime < STATE_STORE_INTERVAL) {
+            return;
+        }
+        if (memcmp(&current, &stored, sizeof(RECORD)) == 0) {
+            dirty = false;                  // back to what is stored, nothing to write
+            return;
+        }
+        writeTime = now;                    // a failed write is retried after the interval
+        Preferences nvs;
+        if (!nvs.begin(STATE_STORE_NAMESPACE, false)) {
+            return;
+        }
+        if (nvs.putBytes(STATE_STORE_KEY, &current, sizeof(RECORD)) == sizeof(RECORD)) {
+            stored = current;
+            dirty = false;
+            writes++;
+            LIGHT_LOG1("Lamp states saved, %u writes since boot\n", writes);
+        }
+        nvs.end();
+    }
+};
+
+STATE_STORE stateStore;                     // lamp states restored at boot
+
+#endif
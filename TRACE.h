@@ -0,0 +1,174 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include "esp_timer.h"
+
+// Compile time log levels for the lighting code. Messages above LIGHT_LOG_LEVEL are
+// removed by the preprocessor, arguments included. Messages that pass are still
+// filtered by the HomeSpan run time log level
+#ifndef LIGHT_LOG_LEVEL
+#define LIGHT_LOG_LEVEL 1
+#endif
+
+#if LIGHT_LOG_LEVEL >= 1
+#define LIGHT_LOG1(...) LOG1(__VA_ARGS__)
+#else
+#define LIGHT_LOG1(...) do {} while (0)
+#endif
+
+#if LIGHT_LOG_LEVEL >= 2
+#define LIGHT_LOG2(...) LOG2(__VA_ARGS__)
+#else
+#define LIGHT_LOG2(...) do {} while (0)
+#endif
+
+// Binary trace for the hot path, 0 removes it completely
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+const char *Action2Name(int action);            // from BUTTON_MANAGER.h, used when formatting
+const char *PressType2Name(int pressType);
+
+#define TRACE_SIZE 128              // trace records kept, power of two
+#define TRACE_COMMAND_CHAR 't'      // serial command that dumps the trace
+
+#if TRACE_ENABLED
+#define TRACE(event, a, b, c) trace.record(event, a, b, c)
+#else
+#define TRACE(event, a, b, c) do {} while (0)
+#endif
+
+// Trace events, arguments are given as (a, b, c)
+enum TRACE_EVENT : uint8_t {
+    TRACE_PRESS,                    // (pin, press type, lamps affected)
+    TRACE_LAMP,                     // (lamp, action, power)
+    TRACE_COMMAND,                  // (lamp, power, first duty)
+    TRACE_SYNC,                     // (lamp, power, 0)
+    TRACE_UPDATE,                   // (lamp, power, first characteristic value)
+    TRACE_EVENTS
+};
+
+// =====================================================================================
+// TRACE_RECORD: One binary trace entry, 12 bytes
+// =====================================================================================
+struct TRACE_RECORD {
+    uint32_t time;                              // esp_timer time in us
+    uint8_t event;                              // TRACE_EVENT
+    uint8_t a;                                  // event arguments
+    uint16_t b;
+    uint32_t c;
+};
+
+// =====================================================================================
+// TRACE: Fixed size ring of binary records, formatted only when dumped
+//
+// Recording is a slot reservation with an atomic increment plus a 12 byte copy, so it
+// can be used from any task. A record being written while the ring is dumped may show
+// mixed arguments, acceptable for a diagnostic trace.
+// =====================================================================================
+struct TRACE {
+
+    TRACE_RECORD records[TRACE_SIZE];           // ring storage
+    std::atomic<uint32_t> next{0};              // records written since boot
+
+    // -----------------------------------------------------------------------------------
+    // record() method
+    //
+    // stores an event
+    // -----------------------------------------------------------------------------------
+    void record(uint8_t event, uint32_t a, uint32_t b, uint32_t c) {
+        uint32_t i = next.fetch_add(1, std::memory_order_relaxed);
+        TRACE_RECORD &r = records[i & (TRACE_SIZE - 1)];
+        r.time = (uint32_t) esp_timer_get_time();
+        r.event = event;
+        r.a = a;
+        r.b = b;
+        r.c = c;
+    }
+
+    // -----------------------------------------------------------------------------------
+    // format() method
+    //
+    // writes a record as text, returns the number of characters written
+    // -----------------------------------------------------------------------------------
+    static int format(const TRACE_RECORD &r, char *buf, size_t size) {
+        unsigned long ms = r.time / 1000;
+        unsigned us = r.time % 1000;
+        switch (r.event) {
+            case TRACE_PRESS:
+                return snprintf(buf, size, "%lu.%03u Button on pin %u got %s press, %u accessories affected", ms, us, r.a, PressType2Name(r.b), r.c);
+            case TRACE_LAMP:
+                return snprintf(buf, size, "%lu.%03u Lamp #%u %s by pushbutton, now %s", ms, us, r.a, Action2Name((int8_t) r.b), r.c ? "ON" : "OFF");
+            case TRACE_COMMAND:
+                return snprintf(buf, size, "%lu.%03u Lamp #%u set %s by HomeKit, duty %u", ms, us, r.a, r.b ? "ON" : "OFF", r.c);
+            case TRACE_SYNC:
+                return snprintf(buf, size, "%lu.%03u Lamp #%u characteristics synchronized, %s", ms, us, r.a, r.b ? "ON" : "OFF");
+            case TRACE_UPDATE:
+                return snprintf(buf, size, "%lu.%03u Lamp #%u updated by HomeKit, Power=%s, first value %u", ms, us, r.a, r.b ? "true" : "false", r.c);
+            default:
+                return snprintf(buf, size, "%lu.%03u Event #%u (%u, %u, %u)", ms, us, r.event, r.a, r.b, r.c);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // dump() method
+    //
+    // formats the records still in the ring, oldest first
+    // print            called once per formatted line
+    // -----------------------------------------------------------------------------------
+    template <typename PRINT>
+    void dump(PRINT print) {
+        char line[96];
+        uint32_t last = next.load(std::memory_order_relaxed);
+        uint32_t i = last > TRACE_SIZE ? last - TRACE_SIZE : 0;
+        for (; i < last; i++) {
+            format(records[i & (TRACE_SIZE - 1)], line, sizeof(line));
+            print(line);
+        }
+    }
+
+    // -----------------------------------------------------------------------------------
+    // serialDump() method
+    //
+    // SpanUserCommand callback, dumps the trace on Serial
+    // -----------------------------------------------------------------------------------
+    static void serialDump(const char *buf);
+
+    // -----------------------------------------------------------------------------------
+    // webLogDump() method
+    //
+    // web log callback, appends the trace to the "log" page
+    // -----------------------------------------------------------------------------------
+    static void webLogDump(String &html);
+
+    // -----------------------------------------------------------------------------------
+    // begin() method
+    //
+    // registers the serial command and the web log callback. Must be called from setup()
+    // after homeSpan.enableWebLog()
+    // -----------------------------------------------------------------------------------
+    void begin() {
+#if TRACE_ENABLED
+        new SpanUserCommand(TRACE_COMMAND_CHAR, "- dumps the lighting trace", serialDump);
+        homeSpan.setWebLogCallback(webLogDump);
+#endif
+    }
+};
+
+TRACE trace;                                // shared by all the lighting code
+
+void TRACE::serialDump(const char *buf) {
+    Serial.printf("\n*** Lighting trace, %u events recorded ***\n\n", trace.next.load());
+    trace.dump([](const char *line) { Serial.printf("%s\n", line); });
+    Serial.printf("\n*** End trace ***\n\n");
+}
+
+void TRACE::webLogDump(String &html) {
+    html += "<p><b>Lighting trace:</b></p><pre>";
+    trace.dump([&html](const char *line) { html += line; html += "\n"; });
+    html += "</pre>";
+}
+
+#endif
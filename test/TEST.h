@@ -0,0 +1,29 @@
+#ifndef TEST_H
+#define TEST_H
+
+// Minimal checks for the host tests, a failed check is reported and the test goes on,
+// TEST_RESULT() gives the exit code
+
+#include <stdio.h>
+
+inline int testFailures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            testFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_MSG(condition, ...) do { \
+        if (!(condition)) { \
+            printf("%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #condition); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            testFailures++; \
+        } \
+    } while (0)
+
+#define TEST_RESULT() (printf(testFailures == 0 ? "PASSED\n" : "FAILED, %d checks\n", testFailures), testFailures == 0 ? 0 : 1)
+
+#endif
@@ -0,0 +1,256 @@
+// =====================================================================================
+// Replay benchmark of the host build
+//
+// setup() and loop() of the sketch run on the simulated chip. Wall switch timelines are
+// played as pin edges with contact bounce and slider drags as HomeKit write requests,
+// while loop() runs as it does on the controller, idle waits and light sleep included.
+// Reported:
+//   press to GPIO      press decided, as the press rules define it, to relay output
+//   HomeKit to PWM     HomeKit write to the LEDC duty shown, latest write wins
+//   loop() cost        host time of a loop() iteration, simulated chip included
+//   allocations        operator new calls while replaying, must be 0
+// Latencies are virtual time, so they only move when the code paths change. "-v" prints
+// the sketch log.
+// =====================================================================================
+
+#include "BedLightController.ino"
+#include <algorithm>
+#include <chrono>
+#include "TEST.h"
+
+#define REPLAY_ROUNDS 20            // times the press timeline is played
+#define REPLAY_DRAGS 10             // slider drags played
+#define REPLAY_DRAG_MS 2000         // length of a slider drag
+#define REPLAY_DRAG_PERIOD_MS 16    // ms between two writes of a drag, about what the Home app sends
+#define REPLAY_WINDOW_MS 100        // a press must reach the outputs within this time of its decision
+#define REPLAY_SAMPLES (1 << 21)    // samples kept per measurement
+#define REPLAY_PENDING 256          // HomeKit writes waiting for the outputs
+
+// =====================================================================================
+// REPLAY_STATS: Samples of one measurement
+// =====================================================================================
+struct REPLAY_STATS {
+
+    uint32_t samples[REPLAY_SAMPLES];           // samples in ns
+    int nSamples = 0;                           // sample counter
+
+    void add(uint64_t ns) {
+        if (nSamples < REPLAY_SAMPLES) {
+            samples[nSamples++] = (uint32_t) ns;
+        }
+    }
+
+    // prints the percentiles in us
+    void report(const char *name) {
+        if (nSamples == 0) {
+            printf("%-24s no samples\n", name);
+            return;
+        }
+        std::sort(samples, samples + nSamples);
+        printf("%-24s n=%-6d p50=%8.2f us  p90=%8.2f us  p99=%8.2f us  max=%8.2f us\n", name, nSamples,
+               samples[nSamples * 50 / 100] / 1e3, samples[nSamples * 90 / 100] / 1e3,
+               samples[nSamples * 99 / 100] / 1e3, samples[nSamples - 1] / 1e3);
+    }
+
+    uint32_t max() {
+        return nSamples == 0 ? 0 : *std::max_element(samples, samples + nSamples);
+    }
+};
+
+REPLAY_STATS pressLatency;
+REPLAY_STATS writeLatency;
+REPLAY_STATS loopCost;
+uint32_t seed = 12345;
+
+// returns a pseudo random number in [min,max], the same on every run
+uint32_t Random(uint32_t min, uint32_t max) {
+    seed = seed * 1103515245 + 12345;
+    return min + (seed >> 8) % (max - min + 1);
+}
+
+// runs loop() until a virtual time
+void RunUntil(uint64_t ns) {
+    while (host.now < ns) {
+        auto start = std::chrono::steady_clock::now();
+        loop();
+        loopCost.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+}
+
+// -------------------------------------------------------------------------------------
+// Pushbutton timelines
+// -------------------------------------------------------------------------------------
+
+void Edge(int pin, int level) {
+    host.setInput(pin, level);
+}
+
+// schedules a bouncing contact change, pushbuttons pull the input LOW
+void Contact(uint64_t time, int pin, boolean down) {
+    host.at(time, Edge, pin, !down);
+    host.at(time + 300000, Edge, pin, down);
+    host.at(time + 900000, Edge, pin, !down);
+}
+
+// -------------------------------------------------------------------------------------
+// schedules a press as a person does it from start and returns the time its type is
+// decided, see PRESS_CLASSIFIER. end is set to the time of the last edge
+// -------------------------------------------------------------------------------------
+uint64_t SchedulePress(uint64_t start, int button, int pressType, uint64_t &end) {
+    int pin = pushbuttons[button];
+    uint64_t ms = 1000000;
+    uint64_t hold = Random(60, 200) * ms;
+    Contact(start, pin, true);
+    if (pressType == SpanButton::LONG) {
+        end = start + Random(1400, 2500) * ms;
+        Contact(end, pin, false);
+        return start + LONGPULSE * ms;
+    }
+    Contact(start + hold, pin, false);
+    if (pressType == SpanButton::SINGLE) {
+        end = start + hold;
+        return end + SHORTPULSE * ms;
+    }
+    uint64_t second = start + hold + Random(60, 200) * ms;
+    end = second + Random(60, 200) * ms;
+    Contact(second, pin, true);
+    Contact(end, pin, false);
+    return second;
+}
+
+// -------------------------------------------------------------------------------------
+// plays the recorded press sequence of BENCHMARK.h, checking every relay against the
+// wiring table
+// -------------------------------------------------------------------------------------
+void ReplayPresses() {
+    boolean model[LAMP_COUNT];
+    for (int i = 0; i < LAMP_COUNT; i++) {
+        model[i] = lighting.lamps[i].power;
+    }
+    uint64_t time = host.now + 1000000000ULL;
+    for (int round = 0; round < REPLAY_ROUNDS; round++) {
+        for (const BENCH_PRESS &p : benchPresses) {
+            uint64_t end;
+            uint64_t decision = SchedulePress(time, p.button, p.pressType, end);
+            boolean before[LAMP_COUNT];
+            uint32_t changes[LAMP_COUNT];
+            int group = p.button * BUTTON_PRESS_TYPES + p.pressType;
+            for (int i = 0; i < LAMP_COUNT; i++) {
+                before[i] = model[i];
+                changes[i] = lighting.lamps[i].relayPin >= 0 ? host.changes[lighting.lamps[i].relayPin] : 0;
+            }
+            for (int e = buttonWiring.first[group]; e < buttonWiring.first[group + 1]; e++) {
+                const BUTTON_DISPATCH &entry = buttonWiring.entry[e];
+                model[entry.lamp] = entry.action == TOGGLE ? !model[entry.lamp] : entry.action == ON;
+            }
+            RunUntil(std::max(decision, end) + REPLAY_WINDOW_MS * 1000000ULL);
+            for (int i = 0; i < LAMP_COUNT; i++) {
+                LAMP &lamp = lighting.lamps[i];
+                if (lamp.relayPin < 0) {
+                    continue;
+                }
+                CHECK_MSG(host.output(lamp.relayPin) == (model[i] ? lamp.relayOnLevel : !lamp.relayOnLevel),
+                          "lamp %d after %s press on button %d", i, PressType2Name(p.pressType), p.button);
+                if (model[i] != before[i] && host.changes[lamp.relayPin] != changes[i]) {
+                    pressLatency.add(host.changeTime[lamp.relayPin] - decision);
+                }
+            }
+            time = host.now + Random(500, 5000) * 1000000ULL;     // some gaps let the controller sleep
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------
+// HomeKit slider drags on the headboard, the outputs are checked on every PWM period
+// -------------------------------------------------------------------------------------
+
+struct PENDING_WRITE {
+    uint64_t time;                              // ns of the write
+    uint16_t duty[RGB_MODEL::CHANNELS];         // duties it must show
+};
+
+PENDING_WRITE pending[REPLAY_PENDING];
+int nPending = 0;
+
+// one write request of a drag: power, hue and brightness
+void Write(int hue, int brightness) {
+    SPAN_WRITE request[] = {{ledStripe->power, 1}, {ledStripe->values[0], (double) hue}, {ledStripe->values[2], (double) brightness}};
+    uint16_t value[3] = {(uint16_t) hue, (uint16_t) ledStripe->values[1]->getVal(), (uint16_t) brightness};
+    if (nPending < REPLAY_PENDING) {
+        pending[nPending].time = host.now;
+        RGB_MODEL::mix(value, pending[nPending].duty);
+        nPending++;
+    }
+    homeSpan.write(request, 3);
+}
+
+// LEDC period boundary: every write shown, or overtaken by a later one shown, is done
+void CheckOutputs() {
+    LAMP &lamp = lighting.lamps[HEADBOARD_LAMP];
+    for (int k = nPending - 1; k >= 0; k--) {
+        boolean shown = true;
+        for (int i = 0; i < lamp.nChannels; i++) {
+            const PWM_STAGE::PWM_OUTPUT &output = pwmStage.outputs[fader.channels[lamp.channel[i]].output];
+            shown = shown && host.channels[output.channel].duty == pwmStage.Duty2Ticks(pending[k].duty[i]);
+        }
+        if (shown) {
+            for (int j = 0; j <= k; j++) {
+                writeLatency.add(host.now - pending[j].time);
+            }
+            for (int j = k + 1; j < nPending; j++) {
+                pending[j - k - 1] = pending[j];
+            }
+            nPending -= k + 1;
+            return;
+        }
+    }
+}
+
+void ReplayDrags() {
+    ledStripe->setFadeTime(0);              // the output jumps to the write, so it can be recognized
+    host.onPeriod = CheckOutputs;
+    for (int drag = 0; drag < REPLAY_DRAGS; drag++) {
+        uint64_t start = host.now + Random(500, 5000) * 1000000ULL;
+        int hue = Random(0, 359);
+        for (int t = 0; t < REPLAY_DRAG_MS; t += REPLAY_DRAG_PERIOD_MS) {
+            host.at(start + t * 1000000ULL, Write, (hue + t / 10) % 360, 10 + Random(0, 90));
+        }
+        RunUntil(start + (REPLAY_DRAG_MS + REPLAY_WINDOW_MS) * 1000000ULL);
+    }
+    CHECK_MSG(nPending == 0, "%d HomeKit writes never reached the outputs", nPending);
+    host.onPeriod = NULL;
+    ledStripe->setFadeTime(FADE_TIME);
+}
+
+int main(int argc, char **argv) {
+    host.verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+    setup();
+    RunUntil(host.now + 3000000000ULL);     // boot settles, the controller goes idle
+
+    uint64_t allocations = host.allocations.load();
+    uint32_t wakeUps = host.wakeUps;
+    ReplayPresses();
+    ReplayDrags();
+    allocations = host.allocations.load() - allocations;
+
+    printf("\n*** Replay, %d rounds of %d presses, %d slider drags ***\n\n", REPLAY_ROUNDS, (int) (sizeof(benchPresses) / sizeof(BENCH_PRESS)), REPLAY_DRAGS);
+    pressLatency.report("press to GPIO");
+    writeLatency.report("HomeKit to PWM");
+    loopCost.report("loop() cost");
+    printf("%-24s %llu\n", "allocations", (unsigned long long) allocations);
+    printf("%-24s %u, %u presses over %d us\n", "light sleep wake ups", host.wakeUps - wakeUps, buttonManager.slowWakes.load(), POWER_WAKE_BOUND_US);
+    printf("%-24s %u below %d MHz\n", "homeSpan.poll() calls", host.slowPolls, host.pmMaxMHz);
+
+    CHECK(pressLatency.nSamples > 0 && writeLatency.nSamples > 0);
+    CHECK(allocations == 0);
+    CHECK(pressLatency.max() <= POWER_HOMEKIT_BOUND_MS * 1000000ULL);
+    CHECK(writeLatency.max() <= 2 * FADE_FRAME_US * 1000ULL + POWER_HOMEKIT_BOUND_MS * 1000000ULL);
+    CHECK(powerManager.lightSleep && buttonManager.slowWakes.load() == 0);
+    CHECK(host.pmMaxMHz == POWER_MAX_MHZ && host.slowPolls == 0);
+
+    printf("\n");
+    homeSpan.processSerialCommand("b");     // the on-device benchmark, run on the simulated chip
+    RunUntil(host.now + 5000000000ULL);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,344 @@
+// Simulated ESP32 of the host build, see HOST.h
+
+#include <chrono>
+#include <new>
+#include "HomeSpan.h"
+#include "soc/gpio_struct.h"
+#include "soc/ledc_struct.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+
+HOST host;
+HardwareSerial Serial;
+EspClass ESP;
+Span homeSpan;
+ledc_dev_t LEDC;
+gpio_dev_t GPIO;
+
+// -------------------------------------------------------------------------------------
+// time
+// -------------------------------------------------------------------------------------
+
+void HOST::advance(uint64_t ns) {
+    uint64_t target = now + ns;
+    while (step(target)) {
+    }
+    moveTo(target);
+}
+
+boolean HOST::wait(uint64_t ns) {
+    uint64_t target = now + ns;
+    waiting = true;
+    while (notifications == 0 && step(target)) {
+    }
+    waiting = false;
+    if (notifications == 0) {
+        moveTo(target);
+    }
+    return notifications > 0;
+}
+
+void HOST::spin(uint64_t ns) {
+    moveTo(now + ns);
+}
+
+void HOST::at(uint64_t time, void (*function)(int a, int b), int a, int b) {
+    if (nEvents == HOST_MAX_EVENTS) {
+        fprintf(stderr, "HOST: too many events scheduled\n");
+        abort();
+    }
+    int i = nEvents++;
+    while (i > 0 && events[i - 1].time > time) {    // same time events keep their order
+        events[i] = events[i - 1];
+        i--;
+    }
+    events[i] = {time, function, a, b};
+}
+
+boolean HOST::step(uint64_t limit) {
+    HOST_TIMER *timer = NULL;
+    uint64_t due = limit + 1;
+    for (int i = 0; i < nTimers; i++) {
+        if (timers[i].running && timers[i].due < due) {
+            timer = &timers[i];
+            due = timers[i].due;
+        }
+    }
+    if (nEvents > 0 && events[0].time < due) {
+        HOST_EVENT event = events[0];
+        nEvents--;
+        for (int i = 0; i < nEvents; i++) {
+            events[i] = events[i + 1];
+        }
+        moveTo(event.time > now ? event.time : now);
+        event.function(event.a, event.b);
+        return true;
+    }
+    if (timer == NULL) {
+        return false;
+    }
+    moveTo(due > now ? due : now);
+    if (timer->period != 0) {
+        timer->due += timer->period;
+    } else {
+        timer->running = false;
+    }
+    timer->callback(timer->arg);
+    return true;
+}
+
+void HOST::moveTo(uint64_t time) {
+    if (time <= now) {
+        return;
+    }
+    if (ledcBits != 0) {
+        uint64_t period = ledcPeriod();
+        for (;;) {
+            boolean pending = false;
+            for (HOST_CHANNEL &channel : channels) {
+                pending = pending || channel.pending;
+            }
+            if (!pending && onPeriod == NULL) {
+                ledcPeriods = (time - ledcStart) / period;      // nothing to show, skip the boundaries
+                break;
+            }
+            uint64_t boundary = ledcStart + (ledcPeriods + 1) * period;
+            if (boundary > time) {
+                break;
+            }
+            now = boundary;
+            ledcPeriods++;
+            for (HOST_CHANNEL &channel : channels) {
+                if (channel.pending) {
+                    channel.duty = channel.shadowDuty;
+                    channel.hpoint = channel.shadowHpoint;
+                    channel.pending = false;
+                }
+            }
+            if (onPeriod != NULL) {
+                onPeriod();
+            }
+        }
+    }
+    now = time;
+}
+
+// -------------------------------------------------------------------------------------
+// GPIO
+// -------------------------------------------------------------------------------------
+
+void HOST::regWrite(int reg, uint32_t value) {
+    int shift = (reg == GPIO_OUT1_W1TS_REG || reg == GPIO_OUT1_W1TC_REG) ? 32 : 0;
+    uint64_t mask = (uint64_t) value << shift;
+    uint64_t next = (reg == GPIO_OUT_W1TS_REG || reg == GPIO_OUT1_W1TS_REG) ? out | mask : out & ~mask;
+    for (int pin = 0; pin < HOST_MAX_PINS; pin++) {
+        if (((next ^ out) >> pin) & 1) {
+            changeTime[pin] = now;
+            changes[pin]++;
+        }
+    }
+    out = next;
+}
+
+uint32_t HOST::regRead(int reg) {
+    return reg == GPIO_IN1_REG ? (uint32_t) (in >> 32) : (uint32_t) in;
+}
+
+void HOST::setInput(int pin, int level) {
+    if ((int) ((in >> pin) & 1) == level) {
+        return;
+    }
+    if (waiting && lightSleepAllowed()) {
+        wakeUps++;                          // the pin wakes the chip, the interrupt runs once it is up
+        spin(HOST_WAKE_NS);
+        wakeCause = ESP_SLEEP_WAKEUP_GPIO;
+        if (sleepExit != NULL) {
+            sleepExit(HOST_WAKE_NS / 1000, NULL);
+        }
+        wakeCause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    }
+    in = level ? in | (1ULL << pin) : in & ~(1ULL << pin);
+    if (interrupt[pin] != NULL) {
+        interrupt[pin](interruptArg[pin]);
+    }
+}
+
+// -------------------------------------------------------------------------------------
+// LEDC
+// -------------------------------------------------------------------------------------
+
+uint32_t HOST::ledcCount() {
+    if (ledcBits == 0) {
+        return 0;
+    }
+    uint64_t period = ledcPeriod();
+    return (uint32_t) (((now - ledcStart) % period) * (1ULL << ledcBits) / period);
+}
+
+void HOST::ledcReset(uint32_t bits, int clock, uint32_t frequency) {
+    ledcBits = bits;
+    ledcClock = clock;
+    ledcFrequency = frequency;
+    ledcStart = now;
+    ledcPeriods = 0;
+    for (HOST_CHANNEL &channel : channels) {        // the restarted timer shows the registers written
+        if (channel.pending) {
+            channel.duty = channel.shadowDuty;
+            channel.hpoint = channel.shadowHpoint;
+            channel.pending = false;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------
+// power management
+// -------------------------------------------------------------------------------------
+
+int HOST::heldLocks(int type) {
+    int held = 0;
+    for (int i = 0; i < nLocks; i++) {
+        held += locks[i].type == type ? locks[i].count : 0;
+    }
+    return held;
+}
+
+boolean HOST::lightSleepAllowed() {               // any lock type keeps light sleep away
+    return pmLightSleep && heldLocks(ESP_PM_NO_LIGHT_SLEEP) + heldLocks(ESP_PM_CPU_FREQ_MAX) + heldLocks(ESP_PM_APB_FREQ_MAX) == 0;
+}
+
+int HOST::cpuMHz() {
+    if (pmMaxMHz == 0) {
+        return 240;                                 // no frequency scaling configured
+    }
+    return heldLocks(ESP_PM_CPU_FREQ_MAX) > 0 ? pmMaxMHz : pmMinMHz;
+}
+
+// -------------------------------------------------------------------------------------
+// logging
+// -------------------------------------------------------------------------------------
+
+void HOST::log(const char *format, ...) {
+    if (!verbose) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    printf("%8.3f ", now / 1e6);
+    vprintf(format, args);
+    va_end(args);
+}
+
+int HardwareSerial::printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+}
+
+uint32_t EspClass::getCycleCount() {
+    return (uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -------------------------------------------------------------------------------------
+// HomeSpan
+// -------------------------------------------------------------------------------------
+
+SpanCharacteristic::SpanCharacteristic(double value) : value(value), newValue(value) {
+    service = homeSpan.lastService;
+    if (service != NULL && service->nCharacteristics < HOST_MAX_CHARACTERISTICS) {
+        service->characteristics[service->nCharacteristics++] = this;
+    }
+}
+
+SpanService::SpanService() {
+    if (homeSpan.nServices < HOST_MAX_SERVICES) {
+        homeSpan.services[homeSpan.nServices++] = this;
+    }
+    homeSpan.lastService = this;
+}
+
+SpanAccessory::SpanAccessory() {
+    homeSpan.lastService = NULL;
+}
+
+SpanUserCommand::SpanUserCommand(char c, const char *s, void (*f)(const char *)) {
+    if (homeSpan.nCommands < HOST_MAX_COMMANDS) {
+        homeSpan.commandChar[homeSpan.nCommands] = c;
+        homeSpan.commandFunction[homeSpan.nCommands++] = f;
+    }
+}
+
+void Span::poll() {
+    host.slowPolls += host.cpuMHz() < host.pmMaxMHz;
+    host.advance(host.pollTime);
+    for (int i = 0; i < nServices; i++) {
+        services[i]->loop();
+    }
+}
+
+void Span::processSerialCommand(const char *c) {
+    for (int i = 0; i < nCommands; i++) {
+        if (commandChar[i] == c[0]) {
+            commandFunction[i](c);
+            return;
+        }
+    }
+}
+
+void Span::write(const SPAN_WRITE *writes, int n) {
+    for (int i = 0; i < n; i++) {
+        writes[i].characteristic->newValue = writes[i].value;
+        writes[i].characteristic->isUpdated = true;
+    }
+    for (int i = 0; i < n; i++) {
+        SpanService *service = writes[i].characteristic->service;
+        boolean first = true;                       // update() once per service, in request order
+        for (int j = 0; j < i; j++) {
+            first = first && writes[j].characteristic->service != service;
+        }
+        if (first) {
+            service->update();
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        writes[i].characteristic->value = writes[i].characteristic->newValue;
+        writes[i].characteristic->isUpdated = false;
+    }
+}
+
+// -------------------------------------------------------------------------------------
+// heap, every operator new is counted
+// -------------------------------------------------------------------------------------
+
+void *operator new(size_t size) {
+    host.allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size != 0 ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    if (p != NULL) {
+        host.frees.fetch_add(1, std::memory_order_relaxed);
+        free(p);
+    }
+}
+
+void operator delete[](void *p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    operator delete(p);
+}
@@ -0,0 +1,171 @@
+#ifndef HOST_H
+#define HOST_H
+
+// Simulated ESP32 for the host build: virtual clock, esp_timer, GPIO, LEDC, power
+// management and heap counters. Every stub header of this directory talks to the single
+// HOST instance, tests drive it directly.
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <atomic>
+
+typedef bool boolean;
+
+#define HOST_MAX_TIMERS 8           // esp_timers that can be created
+#define HOST_MAX_EVENTS 512         // scheduled events pending at once
+#define HOST_MAX_PINS 40            // GPIO pins
+#define HOST_MAX_LOCKS 8            // power management locks
+#define HOST_LEDC_CHANNELS 8        // LEDC channels of one speed mode
+#define HOST_POLL_NS 500000         // time a homeSpan.poll() takes by default
+#define HOST_REG_READ_NS 100        // CPU time of a peripheral register read
+#define HOST_LEDC_SET_NS 2000       // CPU time of ledc_set_duty_with_hpoint()
+#define HOST_LEDC_UPDATE_NS 1000    // CPU time of ledc_update_duty()
+#define HOST_WAKE_NS 500000         // light sleep wake up before the first interrupt runs
+
+// =====================================================================================
+// HOST_TIMER: One esp_timer
+// =====================================================================================
+struct HOST_TIMER {
+    void (*callback)(void *arg);                // timer callback
+    void *arg;                                  // callback argument
+    uint64_t period;                            // period in ns, 0 for one shot
+    uint64_t due;                               // next expiry in ns
+    boolean running;                            // true while started
+};
+
+// =====================================================================================
+// HOST_EVENT: Action scheduled at a virtual time by a test, like a pin change
+// =====================================================================================
+struct HOST_EVENT {
+    uint64_t time;                              // ns
+    void (*function)(int a, int b);             // action
+    int a, b;                                   // action arguments
+};
+
+// =====================================================================================
+// HOST_CHANNEL: One simulated LEDC channel
+//
+// set_duty writes the shadow registers, update_duty asks for them to be taken at the
+// next period boundary, as the low speed channels of the ESP32 do
+// =====================================================================================
+struct HOST_CHANNEL {
+    boolean configured;                         // true once ledc_channel_config() was called
+    int pin;                                    // output pin
+    boolean inverted;                           // output inverted
+    uint32_t duty, hpoint;                      // registers being shown
+    uint32_t shadowDuty, shadowHpoint;          // registers written, not shown yet
+    boolean pending;                            // update requested for the next boundary
+};
+
+// =====================================================================================
+// HOST_LOCK: One power management lock
+// =====================================================================================
+struct HOST_LOCK {
+    int type;                                   // esp_pm_lock_type_t
+    const char *name;                           // lock name
+    int count;                                  // acquisitions not released yet
+};
+
+// =====================================================================================
+// HOST: The simulated chip
+// =====================================================================================
+struct HOST {
+
+    uint64_t now = 0;                           // virtual time in ns, esp_timer_get_time() is now / 1000
+    uint64_t pollTime = HOST_POLL_NS;           // ns taken by every homeSpan.poll()
+    boolean verbose = false;                    // true to print LOG and WEBLOG messages
+
+    // tasks
+    uint32_t notifications = 0;                 // notifications given to the loop() task and not taken
+    boolean waiting = false;                    // true while the loop() task waits, the only time light sleep can start
+
+    // timers and events
+    HOST_TIMER timers[HOST_MAX_TIMERS] = {};
+    int nTimers = 0;
+    HOST_EVENT events[HOST_MAX_EVENTS] = {};    // sorted by time
+    int nEvents = 0;
+
+    // GPIO
+    uint64_t out = 0;                           // output levels
+    uint64_t in = ~0ULL;                        // input levels, pulled up
+    uint64_t changeTime[HOST_MAX_PINS] = {};    // ns of the last output change of each pin
+    uint32_t changes[HOST_MAX_PINS] = {};       // output changes of each pin
+    void (*interrupt[HOST_MAX_PINS])(void *) = {};
+    void *interruptArg[HOST_MAX_PINS] = {};
+
+    // LEDC
+    uint32_t ledcBits = 0;                      // timer resolution, 0 until configured
+    int ledcClock = 0;                          // ledc_clk_cfg_t of the timer
+    uint32_t ledcFrequency = 5000;              // PWM frequency in Hz
+    uint64_t ledcStart = 0;                     // ns the timer was last reset
+    uint64_t ledcPeriods = 0;                   // period boundaries processed since the reset
+    HOST_CHANNEL channels[HOST_LEDC_CHANNELS] = {};
+    void (*onPeriod)() = NULL;                  // called on every period boundary, after the shadow registers were taken
+    boolean rtc8mOn = false;                    // RTC8M kept powered in light sleep
+
+    // power management
+    HOST_LOCK locks[HOST_MAX_LOCKS] = {};
+    int nLocks = 0;
+    boolean pmLightSleep = false;               // automatic light sleep configured
+    int pmMinMHz = 0, pmMaxMHz = 0;             // frequency scaling
+    int pmSleepResult = 0;                      // esp_pm_configure() result when light sleep is asked for, ESP_OK if built in
+    int (*sleepExit)(int64_t, void *) = NULL;   // light sleep exit callback
+    int wakeCause = 0;                          // esp_sleep_get_wakeup_cause()
+    uint32_t wakeUps = 0;                       // wake ups from light sleep by a pin
+    uint32_t slowPolls = 0;                     // homeSpan.poll() calls run below pmMaxMHz
+
+    // heap
+    std::atomic<uint64_t> allocations{0};       // operator new calls
+    std::atomic<uint64_t> frees{0};             // operator delete calls
+
+    // -----------------------------------------------------------------------------------
+    // time
+    // -----------------------------------------------------------------------------------
+    void advance(uint64_t ns);                  // moves the clock running timers and events on the way
+    boolean wait(uint64_t ns);                  // same, stops early once the loop() task is notified
+    void spin(uint64_t ns);                     // moves the clock without running anything, CPU busy
+    void at(uint64_t time, void (*function)(int a, int b), int a = 0, int b = 0);
+    uint64_t us() { return now / 1000; }
+
+    // -----------------------------------------------------------------------------------
+    // GPIO
+    // -----------------------------------------------------------------------------------
+    void regWrite(int reg, uint32_t value);
+    uint32_t regRead(int reg);
+    void setInput(int pin, int level);          // changes an input level raising its interrupt
+    int output(int pin) { return (out >> pin) & 1; }
+
+    // -----------------------------------------------------------------------------------
+    // LEDC
+    // -----------------------------------------------------------------------------------
+    uint64_t ledcPeriod() { return 1000000000ULL / ledcFrequency; }
+    uint32_t ledcCount();
+    void ledcReset(uint32_t bits, int clock, uint32_t frequency);
+
+    // -----------------------------------------------------------------------------------
+    // power management
+    // -----------------------------------------------------------------------------------
+    int heldLocks(int type);
+    boolean lightSleepAllowed();
+    int cpuMHz();                               // CPU frequency under the locks held
+
+    // -----------------------------------------------------------------------------------
+    // heap
+    // -----------------------------------------------------------------------------------
+    uint64_t liveBlocks() { return allocations.load() - frees.load(); }
+
+    // -----------------------------------------------------------------------------------
+    // logging
+    // -----------------------------------------------------------------------------------
+    void log(const char *format, ...);
+
+    // internals
+    void moveTo(uint64_t time);                 // moves the clock, LEDC boundaries included
+    boolean step(uint64_t limit);               // runs the next timer or event before limit, false if none
+};
+
+extern HOST host;
+
+#define HOST_TASK ((void *) &host)              // handle of the task running setup() and loop()
+
+#endif
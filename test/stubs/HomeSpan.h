@@ -0,0 +1,226 @@
+#ifndef HOMESPAN_H
+#define HOMESPAN_H
+
+// Host stub of HomeSpan and the parts of the Arduino core and FreeRTOS the sketch uses.
+// Only the behaviour the lighting code relies on is modelled: characteristic values,
+// update() on HomeKit writes, loop() of every service on poll(), serial commands and
+// task notifications of the loop() task.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include "HOST.h"
+#include "soc/gpio_reg.h"
+
+// -------------------------------------------------------------------------------------
+// Arduino core
+// -------------------------------------------------------------------------------------
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 1
+#define OUTPUT 3
+#define INPUT_PULLUP 5
+#define CHANGE 3
+#define IRAM_ATTR
+#define ARDUINO_ISR_ATTR
+
+inline void pinMode(int pin, int mode) {}
+inline void digitalWrite(int pin, int level) { host.regWrite(pin < 32 ? (level ? GPIO_OUT_W1TS_REG : GPIO_OUT_W1TC_REG) : (level ? GPIO_OUT1_W1TS_REG : GPIO_OUT1_W1TC_REG), 1UL << (pin & 31)); }
+inline int digitalRead(int pin) { return (host.in >> pin) & 1; }
+inline uint32_t millis() { return (uint32_t) (host.now / 1000000); }
+inline uint32_t micros() { return (uint32_t) (host.now / 1000); }
+
+inline void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode) {
+    host.interrupt[pin] = handler;
+    host.interruptArg[pin] = arg;
+}
+
+struct HardwareSerial {
+    void begin(unsigned long baud) {}
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HardwareSerial Serial;
+
+struct EspClass {
+    uint32_t getCycleCount();                   // host steady clock in ns
+    uint32_t getCpuFreqMHz() { return 1000; }   // so one cycle is one ns
+};
+
+extern EspClass ESP;
+
+struct String : std::string {
+    String() {}
+    String(const char *s) : std::string(s) {}
+    String &operator+=(const char *s) { append(s); return *this; }
+};
+
+// -------------------------------------------------------------------------------------
+// FreeRTOS, only the loop() task exists. The lighting engine runs inline
+// -------------------------------------------------------------------------------------
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef int BaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY 0xFFFFFFFF
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((uint32_t) (ms) / portTICK_PERIOD_MS)
+#define portYIELD_FROM_ISR(woken) (void) (woken)
+
+typedef int portMUX_TYPE;                       // one task, critical sections are no-ops
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) (void) (mux)
+#define portEXIT_CRITICAL(mux) (void) (mux)
+#define portENTER_CRITICAL_ISR(mux) (void) (mux)
+#define portEXIT_CRITICAL_ISR(mux) (void) (mux)
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, int, TaskHandle_t *, int) { return pdFAIL; }
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return HOST_TASK; }
+inline int xPortGetCoreID() { return 1; }
+inline void vTaskDelay(uint32_t ticks) { host.advance((uint64_t) ticks * portTICK_PERIOD_MS * 1000000); }
+
+inline void xTaskNotifyGive(TaskHandle_t task) {
+    if (task == HOST_TASK) {
+        host.notifications++;
+    }
+}
+
+inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken) {
+    xTaskNotifyGive(task);
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, uint32_t ticks) {
+    if (host.notifications == 0 && ticks != portMAX_DELAY) {
+        host.wait((uint64_t) ticks * portTICK_PERIOD_MS * 1000000);
+    }
+    uint32_t taken = host.notifications;
+    host.notifications = clear ? 0 : (taken > 0 ? taken - 1 : 0);
+    return taken;
+}
+
+// -------------------------------------------------------------------------------------
+// HomeSpan
+// -------------------------------------------------------------------------------------
+
+#define LOG0(...) host.log(__VA_ARGS__)
+#define LOG1(...) host.log(__VA_ARGS__)
+#define LOG2(...) host.log(__VA_ARGS__)
+#define WEBLOG(format, ...) host.log(format "\n" __VA_OPT__(,) __VA_ARGS__)
+
+#define HOST_MAX_SERVICES 32        // services of every accessory
+#define HOST_MAX_CHARACTERISTICS 8  // characteristics of one service
+#define HOST_MAX_COMMANDS 8         // serial commands
+
+struct SpanService;
+
+struct SpanCharacteristic {
+
+    double value;                               // value as last committed
+    double newValue;                            // value being written by HomeKit
+    boolean isUpdated = false;                  // true while update() runs for a write of this characteristic
+    SpanService *service;                       // owner
+
+    SpanCharacteristic(double value);
+
+    template <typename T = int> T getVal() { return (T) value; }
+    template <typename T = int> T getNewVal() { return (T) newValue; }
+    template <typename T> void setVal(T val, boolean notify = true);
+    boolean updated() { return isUpdated; }
+    SpanCharacteristic *setRange(double min, double max, double step) { return this; }
+};
+
+struct SpanService {
+
+    SpanCharacteristic *characteristics[HOST_MAX_CHARACTERISTICS];
+    int nCharacteristics = 0;
+
+    SpanService();
+    virtual boolean update() { return true; }
+    virtual void loop() {}
+};
+
+struct SpanAccessory {
+    SpanAccessory();
+};
+
+namespace Service {
+struct AccessoryInformation : SpanService {};
+struct LightBulb : SpanService {};
+struct Switch : SpanService {};
+}
+
+namespace Characteristic {
+struct Identify : SpanCharacteristic { Identify() : SpanCharacteristic(0) {} };
+struct On : SpanCharacteristic { On(boolean val = false, boolean nvs = false) : SpanCharacteristic(val) {} };
+struct Hue : SpanCharacteristic { Hue(double val = 0, boolean nvs = false) : SpanCharacteristic(val) {} };
+struct Saturation : SpanCharacteristic { Saturation(double val = 0, boolean nvs = false) : SpanCharacteristic(val) {} };
+struct Brightness : SpanCharacteristic { Brightness(int val = 0, boolean nvs = false) : SpanCharacteristic(val) {} };
+struct ColorTemperature : SpanCharacteristic { ColorTemperature(uint32_t val = 200, boolean nvs = false) : SpanCharacteristic(val) {} };
+struct Name : SpanCharacteristic { const char *name; Name(const char *name) : SpanCharacteristic(0), name(name) {} };
+}
+
+struct SpanButton {
+    enum { SINGLE = 0, DOUBLE = 1, LONG = 2 };
+};
+
+struct SpanUserCommand {
+    SpanUserCommand(char c, const char *s, void (*f)(const char *));
+};
+
+enum class Category { Bridges, Lighting };
+
+#define SPAN_ACCESSORY(...) new SpanAccessory(); new Service::AccessoryInformation(); new Characteristic::Identify(); __VA_OPT__(new Characteristic::Name(__VA_ARGS__);)
+
+// One characteristic of a HomeKit write request
+struct SPAN_WRITE {
+    SpanCharacteristic *characteristic;
+    double value;
+};
+
+struct Span {
+
+    SpanService *services[HOST_MAX_SERVICES];  // every service, in creation order
+    int nServices = 0;
+    SpanService *lastService = NULL;            // service new characteristics belong to
+    char commandChar[HOST_MAX_COMMANDS];        // serial commands
+    void (*commandFunction[HOST_MAX_COMMANDS])(const char *);
+    int nCommands = 0;
+    void (*wifiCallback)() = NULL;
+    void (*webLogCallback)(String &) = NULL;
+    uint32_t events = 0;                        // characteristic changes notified to the controllers
+    int logLevel = 0;
+
+    void setPairingCode(const char *) {}
+    void setControlPin(int) {}
+    void setStatusPin(int) {}
+    void setLogLevel(int level) { logLevel = level; }
+    int getLogLevel() { return logLevel; }
+    void enableWebLog(int, const char *, const char *, const char *) {}
+    void setWifiCallback(void (*f)()) { wifiCallback = f; }
+    void setWebLogCallback(void (*f)(String &)) { webLogCallback = f; }
+    void begin(Category, const char *) {}
+    void poll();
+    void processSerialCommand(const char *c);
+    void write(const SPAN_WRITE *writes, int n);    // one HomeKit write request, as HAP PUT /characteristics
+};
+
+extern Span homeSpan;
+
+template <typename T>
+void SpanCharacteristic::setVal(T val, boolean notify) {
+    value = newValue = (double) val;
+    if (notify) {
+        homeSpan.events++;
+    }
+}
+
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+// Host stub: NVS kept in a static table, so it survives a new setup() in the same test
+// and never allocates
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HOST_NVS_KEYS 4             // keys of every namespace
+#define HOST_NVS_SIZE 512           // bytes of one value
+
+struct HOST_NVS_ENTRY {
+    char key[32];                               // "namespace/key", empty if free
+    size_t length;
+    unsigned char data[HOST_NVS_SIZE];
+};
+
+inline HOST_NVS_ENTRY hostNvs[HOST_NVS_KEYS];
+inline unsigned hostNvsWrites = 0;              // putBytes() calls since start
+
+struct Preferences {
+
+    const char *name = NULL;
+    bool readOnly = true;
+
+    bool begin(const char *name, bool readOnly = false) {
+        this->name = name;
+        this->readOnly = readOnly;
+        return true;
+    }
+
+    void end() {
+        name = NULL;
+    }
+
+    size_t getBytesLength(const char *key) {
+        HOST_NVS_ENTRY *entry = find(key, false);
+        return entry != NULL ? entry->length : 0;
+    }
+
+    size_t getBytes(const char *key, void *buf, size_t maxLength) {
+        HOST_NVS_ENTRY *entry = find(key, false);
+        if (entry == NULL || entry->length > maxLength) {
+            return 0;
+        }
+        memcpy(buf, entry->data, entry->length);
+        return entry->length;
+    }
+
+    size_t putBytes(const char *key, const void *value, size_t length) {
+        HOST_NVS_ENTRY *entry = readOnly || length > HOST_NVS_SIZE ? NULL : find(key, true);
+        if (entry == NULL) {
+            return 0;
+        }
+        memcpy(entry->data, value, length);
+        entry->length = length;
+        hostNvsWrites++;
+        return length;
+    }
+
+    HOST_NVS_ENTRY *find(const char *key, bool create) {
+        char full[32];
+        snprintf(full, sizeof(full), "%s/%s", name, key);
+        for (HOST_NVS_ENTRY &entry : hostNvs) {
+            if (strcmp(entry.key, full) == 0) {
+                return &entry;
+            }
+        }
+        if (create) {
+            for (HOST_NVS_ENTRY &entry : hostNvs) {
+                if (entry.key[0] == 0) {
+                    strcpy(entry.key, full);
+                    return &entry;
+                }
+            }
+        }
+        return NULL;
+    }
+};
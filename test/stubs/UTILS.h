@@ -0,0 +1,4 @@
+#pragma once
+
+// Host stub: the sketch includes the UTILS.h of the author's library folder, nothing of
+// it is used by the lighting code
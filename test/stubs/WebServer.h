@@ -0,0 +1,33 @@
+#pragma once
+
+// Host stub: one page handler, tests call request() and read content
+
+#include <stddef.h>
+#include <string>
+
+#define CONTENT_LENGTH_UNKNOWN ((size_t) -1)
+
+enum HTTPMethod { HTTP_GET };
+
+struct WebServer {
+
+    void (*handler)() = NULL;                   // handler of the only page
+    int code = 0;                               // status of the last response
+    std::string content;                        // body of the last response
+
+    WebServer(int port) {}
+    void on(const char *uri, HTTPMethod method, void (*handler)()) { this->handler = handler; }
+    void begin() {}
+    void handleClient() {}
+    void setContentLength(size_t length) {}
+    void send(int code, const char *type, const char *body) { this->code = code; content = body; }
+    void sendContent(const char *body) { content += body; }
+
+    const std::string &request() {
+        content.clear();
+        if (handler != NULL) {
+            handler();
+        }
+        return content;
+    }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+// Host stub: LEDC driver on top of the simulated channels of HOST, every output runs
+// from one timer as PWM_STAGE configures it
+
+#include <stdint.h>
+#include "HOST.h"
+
+typedef enum { LEDC_HIGH_SPEED_MODE, LEDC_LOW_SPEED_MODE } ledc_mode_t;
+typedef enum { LEDC_TIMER_0, LEDC_TIMER_1, LEDC_TIMER_2, LEDC_TIMER_3 } ledc_timer_t;
+typedef enum { LEDC_AUTO_CLK, LEDC_USE_APB_CLK, LEDC_USE_RTC8M_CLK } ledc_clk_cfg_t;
+typedef int ledc_channel_t;
+typedef int ledc_timer_bit_t;
+
+typedef struct {
+    ledc_mode_t speed_mode;
+    ledc_timer_bit_t duty_resolution;
+    ledc_timer_t timer_num;
+    uint32_t freq_hz;
+    ledc_clk_cfg_t clk_cfg;
+} ledc_timer_config_t;
+
+typedef struct {
+    int gpio_num;
+    ledc_mode_t speed_mode;
+    ledc_channel_t channel;
+    int intr_type;
+    ledc_timer_t timer_sel;
+    uint32_t duty;
+    int hpoint;
+    struct {
+        unsigned int output_invert : 1;
+    } flags;
+} ledc_channel_config_t;
+
+inline int ledc_timer_config(const ledc_timer_config_t *config) {
+    host.ledcReset(config->duty_resolution, config->clk_cfg, config->freq_hz);
+    return 0;
+}
+
+inline int ledc_channel_config(const ledc_channel_config_t *config) {
+    HOST_CHANNEL &channel = host.channels[config->channel];
+    channel.configured = true;
+    channel.pin = config->gpio_num;
+    channel.inverted = config->flags.output_invert;
+    channel.duty = channel.shadowDuty = config->duty;
+    channel.hpoint = channel.shadowHpoint = config->hpoint;
+    channel.pending = false;
+    return 0;
+}
+
+inline int ledc_set_duty_with_hpoint(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty, uint32_t hpoint) {
+    host.spin(HOST_LEDC_SET_NS);
+    host.channels[channel].shadowDuty = duty;
+    host.channels[channel].shadowHpoint = hpoint;
+    return 0;
+}
+
+inline int ledc_update_duty(ledc_mode_t mode, ledc_channel_t channel) {
+    host.spin(HOST_LEDC_UPDATE_NS);
+    host.channels[channel].pending = true;
+    return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+// Host stub: heap blocks are the operator new calls not deleted yet, see HOST.cpp
+
+#include <stddef.h>
+#include <stdint.h>
+#include "HOST.h"
+
+#define MALLOC_CAP_DEFAULT (1 << 12)
+#define HOST_HEAP_SIZE 200000       // free heap reported, a running HomeSpan leaves about this much
+
+typedef struct {
+    size_t total_free_bytes;
+    size_t total_allocated_bytes;
+    size_t largest_free_block;
+    size_t minimum_free_bytes;
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t total_blocks;
+    size_t total_allocated_blocks;
+} multi_heap_info_t;
+
+inline void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps) {
+    *info = {};
+    info->total_free_bytes = info->largest_free_block = info->minimum_free_bytes = HOST_HEAP_SIZE;
+    info->allocated_blocks = info->total_allocated_blocks = (size_t) host.liveBlocks();
+}
+
+inline size_t heap_caps_get_free_size(uint32_t caps) { return HOST_HEAP_SIZE; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t caps) { return HOST_HEAP_SIZE; }
+inline size_t heap_caps_get_largest_free_block(uint32_t caps) { return HOST_HEAP_SIZE; }
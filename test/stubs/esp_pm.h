@@ -0,0 +1,71 @@
+#pragma once
+
+// Host stub: power management locks and configuration, kept in HOST so tests can tell
+// whether light sleep would be entered
+
+#include <stdint.h>
+#include "HOST.h"
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_ERR_NOT_SUPPORTED 0x106
+
+typedef HOST_LOCK *esp_pm_lock_handle_t;
+typedef enum { ESP_PM_CPU_FREQ_MAX, ESP_PM_APB_FREQ_MAX, ESP_PM_NO_LIGHT_SLEEP } esp_pm_lock_type_t;
+
+typedef struct {
+    int max_freq_mhz;
+    int min_freq_mhz;
+    bool light_sleep_enable;
+} esp_pm_config_esp32_t;
+
+inline esp_err_t esp_pm_configure(const void *vconfig) {
+    const esp_pm_config_esp32_t *config = (const esp_pm_config_esp32_t *) vconfig;
+    if (config->light_sleep_enable && host.pmSleepResult != ESP_OK) {
+        return host.pmSleepResult;
+    }
+    host.pmMaxMHz = config->max_freq_mhz;
+    host.pmMinMHz = config->min_freq_mhz;
+    host.pmLightSleep = config->light_sleep_enable;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_pm_lock_create(esp_pm_lock_type_t type, int arg, const char *name, esp_pm_lock_handle_t *handle) {
+    if (host.nLocks == HOST_MAX_LOCKS) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    HOST_LOCK &lock = host.locks[host.nLocks++];
+    lock.type = type;
+    lock.name = name;
+    lock.count = 0;
+    *handle = &lock;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t lock) {
+    lock->count++;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t lock) {
+    lock->count--;
+    return ESP_OK;
+}
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+typedef esp_err_t (*esp_pm_light_sleep_cb_t)(int64_t sleep_time_us, void *arg);
+
+typedef struct {
+    esp_pm_light_sleep_cb_t enter_cb;
+    esp_pm_light_sleep_cb_t exit_cb;
+    void *enter_cb_user_arg;
+    void *exit_cb_user_arg;
+    uint32_t enter_cb_prior;
+    uint32_t exit_cb_prior;
+} esp_pm_sleep_cbs_register_config_t;
+
+inline esp_err_t esp_pm_light_sleep_register_cbs(esp_pm_sleep_cbs_register_config_t *config) {
+    host.sleepExit = config->exit_cb;
+    return ESP_OK;
+}
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+
+// Host stub: sleep configuration, see HOST::setInput() for the wake ups
+
+#include "HOST.h"
+
+typedef enum { ESP_PD_DOMAIN_RTC8M } esp_sleep_pd_domain_t;
+typedef enum { ESP_PD_OPTION_OFF, ESP_PD_OPTION_ON, ESP_PD_OPTION_AUTO } esp_sleep_pd_option_t;
+typedef enum { ESP_SLEEP_WAKEUP_UNDEFINED, ESP_SLEEP_WAKEUP_GPIO = 7 } esp_sleep_source_t;
+
+inline int esp_sleep_pd_config(esp_sleep_pd_domain_t domain, esp_sleep_pd_option_t option) {
+    host.rtc8mOn = option == ESP_PD_OPTION_ON;
+    return 0;
+}
+
+inline int esp_sleep_enable_gpio_wakeup() {
+    return 0;
+}
+
+inline esp_sleep_source_t esp_sleep_get_wakeup_cause() {
+    return (esp_sleep_source_t) host.wakeCause;
+}
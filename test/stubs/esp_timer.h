@@ -0,0 +1,54 @@
+#pragma once
+
+// Host stub: esp_timer on the virtual clock of HOST, callbacks run from HOST::advance()
+// and HOST::wait() at their due time
+
+#include <stdint.h>
+#include "HOST.h"
+
+typedef HOST_TIMER *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+typedef enum { ESP_TIMER_TASK } esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+inline int esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+    if (host.nTimers == HOST_MAX_TIMERS) {
+        return -1;
+    }
+    HOST_TIMER &timer = host.timers[host.nTimers++];
+    timer.callback = args->callback;
+    timer.arg = args->arg;
+    timer.running = false;
+    *handle = &timer;
+    return 0;
+}
+
+inline int esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    timer->period = period * 1000;
+    timer->due = host.now + timer->period;
+    timer->running = true;
+    return 0;
+}
+
+inline int esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout) {
+    timer->period = 0;
+    timer->due = host.now + timeout * 1000;
+    timer->running = true;
+    return 0;
+}
+
+inline int esp_timer_stop(esp_timer_handle_t timer) {
+    timer->running = false;
+    return 0;
+}
+
+inline int64_t esp_timer_get_time() {
+    return (int64_t) host.us();
+}
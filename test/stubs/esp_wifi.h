@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stub: WiFi is always started
+
+#include "esp_pm.h"
+
+typedef enum { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM } wifi_ps_type_t;
+
+inline esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) {
+    return ESP_OK;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// Host stub: HomeSpan LedPin, only its float HSV to RGB conversion is used, kept as in
+// HomeSpan for the colour benchmark
+
+struct LedPin {
+
+    static void HSVtoRGB(float h, float s, float v, float *r, float *g, float *b) {
+        int i = (int) (h / 60.0f) % 6;
+        float f = h / 60.0f - (int) (h / 60.0f);
+        float p = v * (1 - s);
+        float q = v * (1 - f * s);
+        float t = v * (1 - (1 - f) * s);
+        switch (i) {
+            case 0: *r = v; *g = t; *b = p; break;
+            case 1: *r = q; *g = v; *b = p; break;
+            case 2: *r = p; *g = v; *b = t; break;
+            case 3: *r = p; *g = q; *b = v; break;
+            case 4: *r = t; *g = p; *b = v; break;
+            default: *r = v; *g = p; *b = q; break;
+        }
+    }
+};
@@ -0,0 +1,15 @@
+#pragma once
+
+// Host stub: GPIO registers of the simulated chip, see HOST::regWrite()
+
+#include "HOST.h"
+
+#define GPIO_OUT_W1TS_REG 1
+#define GPIO_OUT_W1TC_REG 2
+#define GPIO_OUT1_W1TS_REG 3
+#define GPIO_OUT1_W1TC_REG 4
+#define GPIO_IN_REG 5
+#define GPIO_IN1_REG 6
+
+#define REG_WRITE(reg, value) host.regWrite(reg, value)
+#define REG_READ(reg) host.regRead(reg)
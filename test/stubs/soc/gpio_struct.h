@@ -0,0 +1,16 @@
+#pragma once
+
+// Host stub: per pin interrupt configuration, only written by the sketch
+
+#include <stdint.h>
+
+typedef enum { GPIO_INTR_DISABLE, GPIO_INTR_POSEDGE, GPIO_INTR_NEGEDGE, GPIO_INTR_ANYEDGE, GPIO_INTR_LOW_LEVEL, GPIO_INTR_HIGH_LEVEL } gpio_int_type_t;
+
+struct gpio_dev_t {
+    struct {
+        uint32_t int_type : 3;
+        uint32_t wakeup_enable : 1;
+    } pin[40];
+};
+
+extern gpio_dev_t GPIO;
@@ -0,0 +1,26 @@
+#pragma once
+
+// Host stub: LEDC timer counter of the simulated chip. Every read costs
+// HOST_REG_READ_NS of CPU time, so a busy wait on it sees the counter move
+
+#include <stdint.h>
+#include "HOST.h"
+
+struct HOST_TIMER_COUNT {
+    operator uint32_t() const {
+        host.spin(HOST_REG_READ_NS);
+        return host.ledcCount();
+    }
+};
+
+struct ledc_dev_t {
+    struct {
+        struct {
+            struct {
+                HOST_TIMER_COUNT timer_cnt;
+            } value;
+        } timer[4];
+    } timer_group[2];
+};
+
+extern ledc_dev_t LEDC;
@@ -0,0 +1,117 @@
+// =====================================================================================
+// HSV to duty kernel against the float path it replaced
+//
+// Every HomeKit colour, hue [0,360] by saturation and brightness [0,100], goes through:
+//   LedPin float       LedPin::HSVtoRGB() and a cast to percent, what DEV_RgbLED did
+//   float with gamma   same, then the CIE curve with powf() into 16 bit duties
+//   HSVtoDuty          the fixed point kernel of COLOR.h
+// HSVtoDuty must stay within GAMMA_TOLERANCE of the float reference and be cheaper than
+// it. Times are host ns per conversion, only the ratios mean something for the ESP32.
+// =====================================================================================
+
+#include "HomeSpan.h"
+#include "extras/PwmPin.h"
+#include "COLOR.h"
+#include <chrono>
+#include "TEST.h"
+
+#define GAMMA_TOLERANCE 16          // duty counts out of DUTY_MAX, 0.025%
+#define BENCH_REPEAT 3              // passes over every colour
+
+// CIE 1931 lightness to luminance, as GAMMA_TABLE
+float Lightness2Luminance(float l) {
+    l *= 100;
+    return l <= 8 ? l / 903.3f : powf((l + 16) / 116, 3);
+}
+
+// float reference of HSVtoDuty()
+void FloatDuty(int h, int s, int v, float duty[3]) {
+    float rgb[3];
+    LedPin::HSVtoRGB(h, s / 100.0f, v / 100.0f, &rgb[0], &rgb[1], &rgb[2]);
+    for (int i = 0; i < 3; i++) {
+        duty[i] = Lightness2Luminance(rgb[i]) * DUTY_MAX;
+    }
+}
+
+// runs a conversion over every colour and returns the host ns per conversion
+template <typename CONVERT>
+double Measure(CONVERT convert) {
+    volatile uint32_t sink = 0;
+    uint32_t n = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int repeat = 0; repeat < BENCH_REPEAT; repeat++) {
+        for (int h = 0; h <= 360; h++) {
+            for (int s = 0; s <= 100; s++) {
+                for (int v = 0; v <= 100; v++) {
+                    sink = sink + convert(h, s, v);
+                    n++;
+                }
+            }
+        }
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() / (double) n;
+}
+
+int main() {
+
+    // accuracy against the float reference
+    float worst = 0;
+    int worstH = 0, worstS = 0, worstV = 0;
+    for (int h = 0; h <= 360; h++) {
+        for (int s = 0; s <= 100; s++) {
+            for (int v = 0; v <= 100; v++) {
+                HSV_COLOR color;
+                color.set((uint16_t) h, (uint8_t) s, (uint8_t) v);
+                RGB_DUTY duty;
+                HSVtoDuty(color, duty);
+                float reference[3];
+                FloatDuty(h, s, v, reference);
+                float error = fmaxf(fabsf(duty.r - reference[0]), fmaxf(fabsf(duty.g - reference[1]), fabsf(duty.b - reference[2])));
+                if (error > worst) {
+                    worst = error;
+                    worstH = h, worstS = s, worstV = v;
+                }
+            }
+        }
+    }
+    printf("HSVtoDuty worst error %.1f duty counts at h=%d s=%d v=%d\n", worst, worstH, worstS, worstV);
+    CHECK(worst <= GAMMA_TOLERANCE);
+
+    // resolution where the eye sees it, the old path had one step per percent
+    int levels = 1;
+    for (int v = 1; v <= 10; v++) {
+        levels += BrightnessToDuty(v) != BrightnessToDuty(v - 1);
+    }
+    CHECK(BrightnessToDuty(0) == 0 && BrightnessToDuty(100) == DUTY_MAX && levels == 11);
+    for (uint32_t i = 1; i <= DUTY_MAX; i++) {
+        if (Gamma(i) < Gamma(i - 1)) {
+            CHECK_MSG(false, "Gamma() not monotonic at %u", i);
+            break;
+        }
+    }
+
+    // cost
+    double ledPin = Measure([](int h, int s, int v) {
+        float r, g, b;
+        LedPin::HSVtoRGB(h, s / 100.0f, v / 100.0f, &r, &g, &b);
+        return (uint32_t) (r * 100) + (uint32_t) (g * 100) + (uint32_t) (b * 100);
+    });
+    double floatGamma = Measure([](int h, int s, int v) {
+        float duty[3];
+        FloatDuty(h, s, v, duty);
+        return (uint32_t) duty[0] + (uint32_t) duty[1] + (uint32_t) duty[2];
+    });
+    double fixed = Measure([](int h, int s, int v) {
+        HSV_COLOR color;
+        color.set((uint16_t) h, (uint8_t) s, (uint8_t) v);
+        RGB_DUTY duty;
+        HSVtoDuty(color, duty);
+        return (uint32_t) duty.r + duty.g + duty.b;
+    });
+    printf("%-24s %6.2f ns, 101 levels, no gamma\n", "LedPin float", ledPin);
+    printf("%-24s %6.2f ns, 16 bit, gamma\n", "float with gamma", floatGamma);
+    printf("%-24s %6.2f ns, 16 bit, gamma\n", "HSVtoDuty", fixed);
+    CHECK(fixed < floatGamma);
+
+    return TEST_RESULT();
+}
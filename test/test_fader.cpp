@@ -0,0 +1,78 @@
+// =====================================================================================
+// FADER on the simulated clock
+//
+// One channel fades up, then down and is sent back up in the middle of it. Every frame
+// must show the linear interpolation of its time, a retarget must go on from the duty
+// being shown, and every fade must end on its target after FADE_TIME of frames at
+// FADE_FRAME_US, the timer then stopping and the LEDC output showing the target.
+// =====================================================================================
+
+#include "HomeSpan.h"
+#include "FADER.h"
+#include "TEST.h"
+
+#define FADE_PIN 16                 // output pin of the faded channel
+#define FADE_FRAMES (FADE_TIME * 1000 / FADE_FRAME_US)  // frames of a whole fade
+
+uint32_t frameTime = 0;             // us of the last frame
+uint32_t fadeFrames = 0;            // frames since the last fadeTo()
+uint32_t errors = 0;                // frames off the interpolation
+
+// frame hook: runs before the tick, so it checks the duty the previous frame computed
+void OnFrame(uint32_t now) {
+    const FADER::FADE_CHANNEL &channel = fader.channels[0];
+    if (fadeFrames > 0) {
+        uint32_t elapsed = frameTime - channel.startTime;
+        int32_t expected = elapsed >= channel.duration ? channel.to :
+                           channel.from + (int32_t) (((int64_t) ((int32_t) channel.to - channel.from) * elapsed) / channel.duration);
+        errors += channel.current != expected;
+    }
+    frameTime = now;
+    fadeFrames++;
+}
+
+// -------------------------------------------------------------------------------------
+// starts a fade and runs the clock for a time, returns the frames computed
+// -------------------------------------------------------------------------------------
+uint32_t Fade(uint16_t duty, uint32_t runUs) {
+    fader.fadeTo(0, duty, FADE_TIME);
+    uint32_t frames = fader.frames;
+    fadeFrames = 0;
+    host.advance(runUs * 1000ULL);
+    return fader.frames - frames;
+}
+
+// checks a fade ended on its target, timer stopped and output showing it
+void CheckSettled(uint16_t duty, const char *fade) {
+    host.advance(host.ledcPeriod());        // the last latch is shown from the next PWM period
+    const FADER::FADE_CHANNEL &channel = fader.channels[0];
+    CHECK_MSG(channel.current == duty && channel.duration == 0, "%s ends at %u, not %u", fade, channel.current, duty);
+    CHECK_MSG(!fader.isFading(), "%s leaves the timer running", fade);
+    CHECK_MSG(host.channels[pwmStage.outputs[channel.output].channel].duty == pwmStage.Duty2Ticks(duty), "%s not on the output", fade);
+}
+
+int main() {
+    CHECK(fader.addChannel(FADE_PIN, false, 0, 0) == 0);
+    fader.frameHook = OnFrame;
+    host.advance(1000000);
+
+    // a whole fade up
+    uint32_t frames = Fade(DUTY_MAX, FADE_TIME * 1000 + 2 * FADE_FRAME_US);
+    printf("fade up                  %u frames, %u off the interpolation\n", frames, errors);
+    CHECK(frames == FADE_FRAMES);
+    CHECK(errors == 0);
+    CheckSettled(DUTY_MAX, "fade up");
+
+    // fade down, sent back up in the middle, between two frames
+    Fade(0, FADE_TIME * 1000 / 2 + FADE_FRAME_US / 3);
+    uint16_t shown = fader.channels[0].current;
+    CHECK(shown > DUTY_MAX / 4 && shown < DUTY_MAX * 3 / 4);
+    frames = Fade(DUTY_MAX, FADE_TIME * 1000 + 2 * FADE_FRAME_US);
+    printf("retarget from %5u      %u frames, %u off the interpolation\n", shown, frames, errors);
+    CHECK(fader.channels[0].from == shown);
+    CHECK(frames == FADE_FRAMES + 1);       // not aligned on the frames, the last one is past FADE_TIME
+    CHECK(errors == 0);
+    CheckSettled(DUTY_MAX, "retarget");
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,99 @@
+// =====================================================================================
+// Colour changes on the simulated LEDC never tear
+//
+// MAX_PWM_OUTPUTS outputs get a new frame of duties at random phases of the PWM period,
+// the tail of the period included. On every period boundary all the outputs must show
+// the same frame. A control run sends the frames channel by channel, as LedPin does, and
+// must tear, so the test sees tearing when there is some. The latch is run again once
+// LEDC is clocked from RTC8M for light sleep, which must keep 12 bits at least.
+// =====================================================================================
+
+#include "HomeSpan.h"
+#include "PWM_STAGE.h"
+#include "TEST.h"
+
+#define LEDC_FRAMES 20000           // frames sent per run
+#define LEDC_FIRST_PIN 16           // outputs take the pins upwards
+
+uint32_t seed = 12345;
+uint32_t frame = 0;                 // last frame sent
+uint32_t torn = 0;                  // boundaries showing more than one frame
+uint32_t checked = 0;               // boundaries checked
+
+// returns a pseudo random number in [min,max], the same on every run
+uint32_t Random(uint32_t min, uint32_t max) {
+    seed = seed * 1103515245 + 12345;
+    return min + (seed >> 8) % (max - min + 1);
+}
+
+// duty of an output in a frame, different for every output and for 512 frames in a row
+uint16_t FrameDuty(uint32_t k, int output) {
+    return (uint16_t) (((k % 512) * MAX_PWM_OUTPUTS + output) * 16);
+}
+
+// LEDC period boundary: every output shows the last frame or every output the one before
+void CheckFrame() {
+    int shown[2] = {0, 0};
+    for (int i = 0; i < pwmStage.nOutputs; i++) {
+        uint32_t duty = host.channels[pwmStage.outputs[i].channel].duty;
+        shown[0] += duty == pwmStage.Duty2Ticks(FrameDuty(frame, i));
+        shown[1] += frame > 0 && duty == pwmStage.Duty2Ticks(FrameDuty(frame - 1, i));
+    }
+    torn += shown[0] != pwmStage.nOutputs && shown[1] != pwmStage.nOutputs;
+    checked++;
+}
+
+// -------------------------------------------------------------------------------------
+// sends LEDC_FRAMES frames, each at a random phase once the one before was shown
+// -------------------------------------------------------------------------------------
+template <typename SEND>
+void Run(const char *name, SEND send) {
+    torn = checked = 0;
+    uint32_t deferred = pwmStage.deferred;
+    for (int k = 0; k < LEDC_FRAMES; k++) {
+        host.spin(host.ledcPeriod() + Random(0, host.ledcPeriod()));
+        frame++;
+        send();
+    }
+    host.spin(2 * host.ledcPeriod());
+    printf("%-24s %u boundaries, %u torn, %u latches deferred\n", name, checked, torn, pwmStage.deferred - deferred);
+}
+
+int main() {
+    for (int i = 0; i < MAX_PWM_OUTPUTS; i++) {
+        CHECK(pwmStage.addOutput(LEDC_FIRST_PIN + i, false, FrameDuty(0, i), PWM_PHASE_SHIFT ? i * (DUTY_MAX / MAX_PWM_OUTPUTS) : 0) == i);
+    }
+    host.onPeriod = CheckFrame;
+
+    Run("channel by channel", []() {
+        for (int i = 0; i < pwmStage.nOutputs; i++) {
+            PWM_STAGE::PWM_OUTPUT &output = pwmStage.outputs[i];
+            output.duty = FrameDuty(frame, i);
+            ledc_set_duty_with_hpoint(PWM_MODE, output.channel, pwmStage.Duty2Ticks(output.duty), pwmStage.hpoint(output));
+            ledc_update_duty(PWM_MODE, output.channel);
+        }
+    });
+    CHECK(torn > 0);
+
+    Run("PWM_STAGE latch", []() {
+        for (int i = 0; i < pwmStage.nOutputs; i++) {
+            pwmStage.stage(i, FrameDuty(frame, i));
+        }
+        pwmStage.latch();
+    });
+    CHECK(checked > 0 && torn == 0);
+    CHECK(pwmStage.latches == LEDC_FRAMES && pwmStage.deferred > 0);
+
+    pwmStage.switchClock(true);
+    printf("%-24s %u bits at %llu Hz\n", "RTC8M clock", host.ledcBits, (unsigned long long) (1000000000ULL / host.ledcPeriod()));
+    CHECK(host.ledcBits == PWM_SLEEP_BITS && host.ledcBits >= 12 && host.ledcPeriod() == 1000000000ULL / PWM_SLEEP_FREQUENCY);
+    Run("PWM_STAGE latch, RTC8M", []() {
+        for (int i = 0; i < pwmStage.nOutputs; i++) {
+            pwmStage.stage(i, FrameDuty(frame, i));
+        }
+        pwmStage.latch();
+    });
+    CHECK(checked > 0 && torn == 0);
+
+    return TEST_RESULT();
+}
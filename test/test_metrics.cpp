@@ -0,0 +1,42 @@
+// =====================================================================================
+// Metrics page
+//
+// The page is requested with a lamp name as long as a label allows. Every line must be
+// a comment or a whole sample, name, labels and value, and every histogram must end with
+// its _sum and _count lines.
+// =====================================================================================
+
+#include "BedLightController.ino"
+#include <sstream>
+#include "TEST.h"
+
+int main() {
+    setup();
+    static char name[METRIC_LABEL_SIZE - 8];          // lamp="" takes the rest of the label
+    memset(name, 'x', sizeof(name) - 1);
+    metrics.lampNames[0] = name;
+    metrics.pressLatency[0].record(150);
+    METRICS::startServer();
+
+    std::istringstream page(metrics.server->request());
+    std::string line;
+    int samples = 0, sums = 0, counts = 0, histograms = 0;
+    while (std::getline(page, line)) {
+        if (line.rfind("# ", 0) == 0) {
+            histograms += line.find(" histogram") != std::string::npos;
+            continue;
+        }
+        size_t space = line.rfind(' ');
+        boolean whole = space != std::string::npos && space + 1 < line.size() && line.find_first_not_of("0123456789", space + 1) == std::string::npos &&
+                        (line.find('{') == std::string::npos || line[space - 1] == '}');
+        CHECK_MSG(whole, "line \"%s\"", line.c_str());
+        samples++;
+        sums += line.find("_sum") != std::string::npos;
+        counts += line.find("_count") != std::string::npos;
+    }
+    printf("%d samples, %d histogram types, %d sums, %d counts\n", samples, histograms, sums, counts);
+    CHECK(histograms > 0 && sums == counts && sums >= histograms);
+    CHECK(metrics.server->request().find(std::string("lamp=\"") + name + "\"} 1\n") != std::string::npos);
+
+    return TEST_RESULT();
+}
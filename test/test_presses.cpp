@@ -0,0 +1,116 @@
+// =====================================================================================
+// Heap watermark under pushbutton presses
+//
+// 10,000 wall switch presses through setup() and loop(): single, double and long ones,
+// the long ones turning the headboard off while HomeKit turns it back on between them. Once
+// warmed up no press may allocate, the heap must stay at the same number of blocks and
+// the headboard must keep its characteristics and colour. Last, presses overflow the
+// event queue while loop() is stalled and HomeKit must still end up with the lamp state.
+// =====================================================================================
+
+#include "BedLightController.ino"
+#include "TEST.h"
+
+#define TEST_PRESSES 10000          // presses checked
+#define TEST_WARM_UP 100            // presses before the watermark is taken
+
+uint64_t Ms(uint64_t ms) {
+    return ms * 1000000;
+}
+
+void Edge(int pin, int level) {
+    host.setInput(pin, level);
+}
+
+// runs loop() until a virtual time
+void RunUntil(uint64_t ns) {
+    while (host.now < ns) {
+        loop();
+    }
+}
+
+// -------------------------------------------------------------------------------------
+// presses a pushbutton and runs loop() until the press is decided and applied
+// -------------------------------------------------------------------------------------
+void Press(int button, int pressType) {
+    int pin = pushbuttons[button];
+    uint64_t start = host.now + Ms(50);
+    uint64_t end = start + (pressType == SpanButton::LONG ? Ms(LONGPULSE + 100) : Ms(60));
+    host.at(start, Edge, pin, LOW);
+    host.at(end, Edge, pin, HIGH);
+    if (pressType == SpanButton::DOUBLE) {
+        host.at(end + Ms(80), Edge, pin, LOW);
+        host.at(end + Ms(140), Edge, pin, HIGH);
+        end += Ms(140);
+    }
+    RunUntil(end + Ms(SHORTPULSE + 50));
+}
+
+int main() {
+    host.pollTime = 2000000;                // a HomeSpan poll() with WiFi, keeps the test short
+    setup();
+    RunUntil(Ms(1000));
+
+    SPAN_WRITE color[] = {{ledStripe->power, 1}, {ledStripe->values[0], 120}, {ledStripe->values[1], 80}, {ledStripe->values[2], 60}};
+    homeSpan.write(color, 4);
+    int nServices = homeSpan.nServices;
+    int nCharacteristics = ledStripe->nCharacteristics;
+
+    uint64_t allocations = 0;
+    uint64_t blocks = 0;
+    uint32_t headboardOff = 0;
+    uint32_t writes = 0;
+    boolean ceiling = lighting.lamps[CEILING_LAMP].power;
+    for (int i = 0; i < TEST_PRESSES; i++) {
+        if (i == TEST_WARM_UP) {
+            allocations = host.allocations.load();
+            blocks = host.liveBlocks();
+        }
+        switch (i % 3) {
+            case 0:
+                Press(0, SpanButton::SINGLE);           // ceiling lamp toggles
+                ceiling = !ceiling;
+                break;
+            case 1:
+                Press(0, SpanButton::DOUBLE);           // reading and standing lamps toggle, ceiling off
+                ceiling = false;
+                break;
+            default: {
+                SPAN_WRITE on[] = {{ledStripe->power, 1}};
+                homeSpan.write(on, 1);                  // HomeKit turns the headboard on, not a press
+                RunUntil(host.now + Ms(50));
+                writes++;
+                Press(1, SpanButton::LONG);             // everything off
+                ceiling = false;
+                headboardOff += ledStripe->power->getVal() == 0;
+                break;
+            }
+        }
+        CHECK_MSG(host.output(CEILING_LAMP_PIN) == (ceiling ? LOW : HIGH), "press %d", i);
+    }
+
+    printf("%d presses, %u HomeKit writes, %llu allocations after warm up, heap blocks %+lld, headboard turned off %u times\n",
+           TEST_PRESSES, writes, (unsigned long long) (host.allocations.load() - allocations), (long long) (host.liveBlocks() - blocks),
+           headboardOff);
+    CHECK(host.allocations.load() == allocations);
+    CHECK(host.liveBlocks() == blocks);
+    CHECK(headboardOff == writes && writes == TEST_PRESSES / 3);
+    CHECK(homeSpan.nServices == nServices && ledStripe->nCharacteristics == nCharacteristics);
+    CHECK(ledStripe->values[0]->getVal() == 120 && ledStripe->values[1]->getVal() == 80 && ledStripe->values[2]->getVal() == 60);
+
+    // loop() stalled, in pairing say, while presses overflow the event queue
+    BUTTON_DISPATCH toggle;
+    toggle.lamp = CEILING_LAMP;
+    toggle.action = TOGGLE;
+    uint32_t dropped = metrics.droppedEvents.load();
+    for (int i = 0; i < 2 * LIGHTING_QUEUE_SIZE + 1; i++) {
+        lighting.press(&toggle, 1);
+    }
+    loop();
+    printf("%u pushbutton events lost while loop() stalled\n", metrics.droppedEvents.load() - dropped);
+    CHECK(metrics.droppedEvents.load() - dropped == LIGHTING_QUEUE_SIZE + 1);
+    CHECK(ceilingLamp->power->getVal() == lighting.lamps[CEILING_LAMP].power);
+    CHECK(host.output(CEILING_LAMP_PIN) == (lighting.lamps[CEILING_LAMP].power ? LOW : HIGH));
+
+    return TEST_RESULT();
+}
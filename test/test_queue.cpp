@@ -0,0 +1,90 @@
+// =====================================================================================
+// SPSC_QUEUE under concurrent threads
+//
+// QUEUE_PAIRS producer and consumer pthreads run at once, each pair on its own queue of
+// LIGHTING_QUEUE_SIZE, as the lighting queues are used. Producers push numbered items
+// whose every word is derived from the number, consumers check they get all of them,
+// in order and never torn. The indexes start just below their wrap around.
+// =====================================================================================
+
+#include "HomeSpan.h"
+#include "SPSC_QUEUE.h"
+#include <pthread.h>
+#include <sched.h>
+#include "TEST.h"
+
+#define QUEUE_PAIRS 4               // producer and consumer pairs running at once
+#define QUEUE_ITEMS 2000000         // items sent by every producer
+#define QUEUE_SIZE 32               // as LIGHTING_QUEUE_SIZE
+
+// =====================================================================================
+// ITEM: Several words, so a torn copy shows
+// =====================================================================================
+struct ITEM {
+    uint32_t sequence;
+    uint32_t word[5];
+};
+
+// =====================================================================================
+// PAIR: One queue and what its threads found
+// =====================================================================================
+struct PAIR {
+    SPSC_QUEUE<ITEM, QUEUE_SIZE> queue;
+    uint64_t full = 0;                          // pushes refused, producer side
+    uint64_t empty = 0;                         // pops with nothing, consumer side
+    uint32_t received = 0;                      // items popped
+    uint32_t errors = 0;                        // items out of order or torn
+};
+
+PAIR pairs[QUEUE_PAIRS];
+
+void *Produce(void *arg) {
+    PAIR *pair = (PAIR *) arg;
+    for (uint32_t i = 0; i < QUEUE_ITEMS; i++) {
+        ITEM item = {i, {i * 3, ~i, i ^ 0x5A5A5A5A, i + 7, i * 0x9E3779B9}};
+        while (!pair->queue.push(item)) {
+            pair->full++;
+            sched_yield();                  // the host may have fewer cores than threads
+        }
+    }
+    return NULL;
+}
+
+void *Consume(void *arg) {
+    PAIR *pair = (PAIR *) arg;
+    ITEM item;
+    while (pair->received < QUEUE_ITEMS) {
+        if (!pair->queue.pop(item)) {
+            pair->empty++;
+            sched_yield();
+            continue;
+        }
+        uint32_t i = pair->received++;
+        if (item.sequence != i || item.word[0] != i * 3 || item.word[1] != ~i || item.word[2] != (i ^ 0x5A5A5A5A) ||
+            item.word[3] != i + 7 || item.word[4] != i * 0x9E3779B9) {
+            pair->errors++;
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[QUEUE_PAIRS * 2];
+    for (int i = 0; i < QUEUE_PAIRS; i++) {
+        pairs[i].queue.head = pairs[i].queue.tail = 0xFFFFFFFF - QUEUE_ITEMS / 2;   // wraps half way
+        pthread_create(&threads[2 * i], NULL, Consume, &pairs[i]);
+        pthread_create(&threads[2 * i + 1], NULL, Produce, &pairs[i]);
+    }
+    for (pthread_t &thread : threads) {
+        pthread_join(thread, NULL);
+    }
+    for (int i = 0; i < QUEUE_PAIRS; i++) {
+        PAIR &pair = pairs[i];
+        ITEM item;
+        printf("queue %d: %u items, %u errors, %llu pushes on full, %llu pops on empty\n", i, pair.received, pair.errors,
+               (unsigned long long) pair.full, (unsigned long long) pair.empty);
+        CHECK(pair.received == QUEUE_ITEMS && pair.errors == 0);
+        CHECK(!pair.queue.pop(item));
+    }
+    return TEST_RESULT();
+}
@@ -0,0 +1,77 @@
+// =====================================================================================
+// Scene turning the headboard on with an effect
+//
+// A Home scene sends the headboard On and Brightness and turns the Sunrise switch on in
+// one write request. The effect must play and its switch stay on, the write to the light
+// must not stop the effect it comes with, whatever the order of the request. Played with
+// the headboard off and on, the switch last and first in the request.
+// =====================================================================================
+
+#include "BedLightController.ino"
+#include "TEST.h"
+
+#define SCENE_EFFECT 0              // Sunrise
+#define SCENE_RUN_MS 3000           // loop() time after the scene, many fader frames and light writes due
+
+// runs loop() until a virtual time
+void RunUntil(uint64_t ns) {
+    while (host.now < ns) {
+        loop();
+    }
+}
+
+// returns the switch of an effect of the headboard
+DEV_EffectSwitch *EffectSwitch(int effect) {
+    for (int i = 0; i < homeSpan.nServices; i++) {
+        DEV_EffectSwitch *effectSwitch = dynamic_cast<DEV_EffectSwitch *>(homeSpan.services[i]);
+        if (effectSwitch != NULL && effectSwitch->light == ledStripe && effectSwitch->effect == effect) {
+            return effectSwitch;
+        }
+    }
+    return NULL;
+}
+
+// -------------------------------------------------------------------------------------
+// plays the scene and checks the effect is playing once loop() ran a while
+// switchFirst      true if the switch comes first in the request
+// -------------------------------------------------------------------------------------
+void Scene(DEV_EffectSwitch *effectSwitch, int brightness, boolean switchFirst) {
+    SPAN_WRITE light[] = {{ledStripe->power, 1}, {ledStripe->values[2], (double) brightness}, {effectSwitch->on, 1}};
+    SPAN_WRITE reversed[] = {{effectSwitch->on, 1}, {ledStripe->power, 1}, {ledStripe->values[2], (double) brightness}};
+    homeSpan.write(switchFirst ? reversed : light, 3);
+    RunUntil(host.now + SCENE_RUN_MS * 1000000ULL);
+    CHECK_MSG(effectPlayer.playing(HEADBOARD_LAMP) == SCENE_EFFECT, "effect %d playing at brightness %d, switch %s", effectPlayer.playing(HEADBOARD_LAMP),
+              brightness, switchFirst ? "first" : "last");
+    CHECK_MSG(effectSwitch->on->getVal() == 1, "switch off at brightness %d, switch %s", brightness, switchFirst ? "first" : "last");
+    CHECK(ledStripe->power->getVal() == 1 && ledStripe->values[2]->getVal() == brightness);
+}
+
+// turns the switch off and checks the effect stops
+void Stop(DEV_EffectSwitch *effectSwitch) {
+    SPAN_WRITE off[] = {{effectSwitch->on, 0}};
+    homeSpan.write(off, 1);
+    RunUntil(host.now + SCENE_RUN_MS * 1000000ULL);
+    CHECK(effectPlayer.playing(HEADBOARD_LAMP) != SCENE_EFFECT);
+}
+
+int main() {
+    setup();
+    RunUntil(1000000000ULL);
+    DEV_EffectSwitch *effectSwitch = EffectSwitch(SCENE_EFFECT);
+    CHECK(effectSwitch != NULL);
+    if (effectSwitch == NULL) {
+        return TEST_RESULT();
+    }
+
+    for (int switchFirst = 0; switchFirst < 2; switchFirst++) {
+        SPAN_WRITE off[] = {{ledStripe->power, 0}};
+        homeSpan.write(off, 1);
+        RunUntil(host.now + SCENE_RUN_MS * 1000000ULL);
+        Scene(effectSwitch, 70, switchFirst);   // headboard off before
+        Stop(effectSwitch);
+        Scene(effectSwitch, 40, switchFirst);   // headboard on before
+        Stop(effectSwitch);
+    }
+
+    return TEST_RESULT();
+}
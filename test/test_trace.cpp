@@ -0,0 +1,68 @@
+// =====================================================================================
+// Cost of the hot path logging
+//
+// A pushbutton event records its trace entries (press, then one per lamp) as
+// LIGHTING::press() does. Compared with formatting the same lines, what the LOG2 calls
+// did on every event, and with sending them at 115200 baud. Log messages above
+// LIGHT_LOG_LEVEL must not even evaluate their arguments.
+// =====================================================================================
+
+#define LIGHT_LOG_LEVEL 1
+#include "HomeSpan.h"
+#include "BUTTON_MANAGER.h"
+#include <chrono>
+#include "TEST.h"
+
+#define TRACE_EVENTS_TIMED 1000000  // pushbutton events timed
+#define EVENT_LAMPS 4               // lamps changed by the event, a long press on the wall switch
+#define UART_NS_PER_BYTE 86806      // 10 bits at 115200 baud
+
+int evaluated = 0;
+
+int Argument() {
+    return ++evaluated;
+}
+
+// host ns per call of a function
+template <typename FUNCTION>
+double Measure(FUNCTION function) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < TRACE_EVENTS_TIMED; i++) {
+        function(i);
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() / (double) TRACE_EVENTS_TIMED;
+}
+
+int main() {
+    LIGHT_LOG2("%d", Argument());
+    CHECK(evaluated == 0);
+
+    double record = Measure([](int i) {
+        TRACE(TRACE_PRESS, 16, SpanButton::LONG, EVENT_LAMPS);
+        for (int lamp = 0; lamp < EVENT_LAMPS; lamp++) {
+            TRACE(TRACE_LAMP, lamp, OFF, i & 1);
+        }
+    });
+
+    static char line[96];
+    static size_t bytes;
+    bytes = 0;
+    double format = Measure([](int i) {
+        TRACE_RECORD r = {(uint32_t) i, TRACE_PRESS, 16, SpanButton::LONG, EVENT_LAMPS};
+        bytes += TRACE::format(r, line, sizeof(line));
+        for (int lamp = 0; lamp < EVENT_LAMPS; lamp++) {
+            r = {(uint32_t) i, TRACE_LAMP, (uint8_t) lamp, OFF, (uint32_t) (i & 1)};
+            bytes += TRACE::format(r, line, sizeof(line));
+        }
+    });
+    double uart = (double) bytes / TRACE_EVENTS_TIMED * UART_NS_PER_BYTE;
+
+    printf("%-24s %10.1f ns per event\n", "binary trace", record);
+    printf("%-24s %10.1f ns per event\n", "formatted lines", format);
+    printf("%-24s %10.1f ns per event, %.0f bytes\n", "Serial at 115200", uart, (double) bytes / TRACE_EVENTS_TIMED);
+    CHECK(trace.next.load() == TRACE_EVENTS_TIMED * (EVENT_LAMPS + 1));
+    CHECK(record < format);
+    CHECK(record * 1000 < uart);
+
+    return TEST_RESULT();
+}